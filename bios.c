@@ -5,15 +5,13 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <poll.h>
 
 #include "util.h"
 #include "bios.h"
@@ -52,6 +50,10 @@ typedef struct core
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	/* Bitmaps of the serial ports which raised SERIAL_RX_READY (index 0) 
+	   and SERIAL_TX_READY (index 1) on this core */
+	volatile uint64_t serial_pending[2];
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -94,6 +96,9 @@ static volatile sig_atomic_t PIC_active;
 /* Bit vector denoting halted cores */
 static _Atomic uint32_t halt_vector;
 
+/* Bit vector denoting cores asked to restart, which have not halted yet */
+static _Atomic uint32_t restart_vector;
+
 /* PIC thread id */
 static pthread_t PIC_thread;
 
@@ -156,10 +161,16 @@ static inline Core* curr_core() {
 	return CORE+cpu_core_id;
 }
 
+/*
+	The interrupt status of the calling core, kept in step with its 
+	SIGUSR1 mask by the functions that change the mask, so that 
+	cpu_interrupts_enabled() needs no system call.
+ */
+static _Thread_local int core_interrupts_on;
+
 
 /*
-	Cause PIC daemon to loop. This needs to happen when we wish 
-	the PIC daemon to refresh the list of fds it is polling.
+	Wake up the PIC daemon, e.g., when it must check PIC_active.
  */
 static inline void interrupt_pic_thread()
 {
@@ -180,6 +191,7 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->serial_pending[0] = core->serial_pending[1] = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -189,6 +201,7 @@ static void* core_thread(void* _core)
 
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
+	core_interrupts_on = 1;
 
 	/* create a thread-specific timer */
 	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
@@ -353,7 +366,11 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	/* SIGUSR1 is blocked while the handler runs */
+	int intr = core_interrupts_on;
+	core_interrupts_on = 0;
 	dispatch_interrupts(core);
+	core_interrupts_on = intr;
 }
 
 
@@ -386,11 +403,17 @@ static TimerDuration get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed (as reported by epoll).
 
-	A not-ready device is made ready when select() returns it as such.
+	Each device is registered with the epoll instance of the PIC, in 
+	edge-triggered, one-shot mode. A device is armed in epoll exactly when
+	it is not ready.
 
-	A ready device is made not-ready on each failed attempt to do an I/O transfer.
+	A not-ready device is made ready when epoll reports it as such.
+
+	A ready device is made not-ready (and re-armed) on each failed attempt 
+	to do an I/O transfer. Re-arming makes epoll check the device again,
+	so that no event can be lost between the failed transfer and the re-arming.
 
 	When a not-ready device becomes ready, an interrupt is raised.
  */
@@ -413,52 +436,59 @@ typedef struct io_device
 
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
+	volatile int hangup;		/* the other end is disconnected */
 	TimerDuration last_int;	    /* used by PIC for timeouts */
+	uint32_t tag;				/* identifies the device in epoll events */
 } io_device;
 
 
+/* The epoll instance of the PIC */
+static int PIC_epfd = -1;
+
+
 /*
-	Determine device readiness without blocking
+	(Re-)arm the device in the PIC epoll instance. If the device is
+	ready at this time, an event is reported.
  */
-static int io_device_ready(int fd, io_direction dir) {
-	struct pollfd pfd;
-	pfd.fd = fd;
-	int evt = (dir==IODIR_RX) ? POLLIN : POLLOUT;
-	pfd.events = evt;
-	CHECK(poll(&pfd, 1, 0));
-	return (pfd.revents & evt) ? 1 : 0;
+static void io_device_arm(io_device* this, int op)
+{
+	if(this->hangup) return;
+	struct epoll_event evt;
+	evt.events = ((this->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT) | EPOLLET | EPOLLONESHOT;
+	evt.data.u64 = 0;
+	evt.data.u32 = this->tag;
+	CHECK(epoll_ctl(PIC_epfd, op, this->fd, &evt));
 }
 
 
 /*
-	Check that the a device is connected and in a good state.
+	Mark the device as not ready, after a failed transfer.
  */
-static int io_device_check(io_device* dev)
+static inline void io_device_not_ready(io_device* this)
 {
-	struct pollfd fds = { .fd=dev->fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	rc = (fds.revents & (POLLHUP|POLLERR))==0;
-	assert(rc);
-	return rc;
+	if(__atomic_exchange_n(&this->ready, 0, __ATOMIC_ACQ_REL))
+		io_device_arm(this, EPOLL_CTL_MOD);
 }
 
 
-
 /*
-	Initialize device
+	Initialize device. The device starts as not ready and armed; if it is
+	ready, the PIC will find out immediately.
  */
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static void io_device_init(io_device* this, int fd, io_direction iodir, uint32_t tag)
 {
 	this->fd = fd;
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
-	this->ready = io_device_ready(fd, iodir);
+	this->ready = 0;
+	this->hangup = 0;
 	this->last_int = get_coarse_time();
+	this->tag = tag;
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
+
+	io_device_arm(this, EPOLL_CTL_ADD);
 }
 
 /*
@@ -473,69 +503,109 @@ static int io_device_destroy(io_device* this)
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Read up to 'size' bytes with one system call. Return the number of
+	bytes read.
+ */
+static uint io_device_read(io_device* this, char* buf, uint size)
 {
 	assert(this->iodir == IODIR_RX);
 	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
+	while((rc=read(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
+	int ok = rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
 	if(!ok) perror("io_device_read:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	}
-	return rc==1;
+	if(rc<1)
+		io_device_not_ready(this);
+	return (rc>0) ? rc : 0;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Write up to 'size' bytes with one system call. Return the number of
+	bytes written.
+ */
+static uint io_device_write(io_device* this, const char* buf, uint size)
 {
 	assert(this->iodir == IODIR_TX);
 
 	/* Try to write */
 	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	while((rc = write(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	int ok = rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
 	if(! ok) perror("io_device_write:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
+	if(rc<(int)size)
+		io_device_not_ready(this);
 
-	return rc==1;
+	return (rc>0) ? rc : 0;
 }
 
 
 
 
 
+/* The size of the keyboard staging buffer of a terminal */
+#define SERIAL_STAGE_SIZE 1024
+
 /*
-	A terminal encapsulates two io_devices: a console and a keyboard
+	A terminal encapsulates two io_devices: a console and a keyboard.
+
+	Keyboard input is read ahead into a staging buffer, a whole chunk per
+	read() system call, so that small reads (e.g., byte-by-byte) do not
+	cost one system call each. The staging buffer is only accessed by
+	bios_read_serial*(), which the caller serializes per serial port.
  */
 typedef struct terminal
 {
 	io_device con, kbd;            /* fds for terminal fifos */
+
+	uint rx_pos, rx_len;           /* the staged data is rx_stage[rx_pos..rx_len) */
+	char rx_stage[SERIAL_STAGE_SIZE];
 } terminal;
 
 /* The terminal table */
 static terminal TERM[MAX_TERMINALS];
 
+/* The pending serial ports of a core are kept in 64-bit bitmaps */
+_Static_assert(MAX_TERMINALS <= 64, "MAX_TERMINALS cannot exceed 64");
+
 /* Current number of terminals */
 static uint nterm = 0;
 
 /*
 	Init the devices for this terminal
  */
-static void terminal_init(terminal* this, int fdin, int fdout)
+static void terminal_init(terminal* this, uint termno, int fdin, int fdout)
 {
-	io_device_init(& this->kbd, fdin, IODIR_RX);
-	io_device_init(& this->con, fdout, IODIR_TX);
+	io_device_init(& this->kbd, fdin, IODIR_RX, 2*termno+IODIR_RX);
+	io_device_init(& this->con, fdout, IODIR_TX, 2*termno+IODIR_TX);
+	this->rx_pos = this->rx_len = 0;
+}
+
+
+/*
+	Read keyboard input, from the staging buffer if it is not empty.
+	Large reads bypass the staging buffer.
+ */
+static uint terminal_read(terminal* this, char* buf, uint size)
+{
+	if(this->rx_pos == this->rx_len) {
+		if(size >= SERIAL_STAGE_SIZE)
+			return io_device_read(& this->kbd, buf, size);
+		this->rx_pos = 0;
+		this->rx_len = io_device_read(& this->kbd, this->rx_stage, SERIAL_STAGE_SIZE);
+	}
+
+	uint count = this->rx_len - this->rx_pos;
+	if(count > size) count = size;
+	memcpy(buf, this->rx_stage + this->rx_pos, count);
+	this->rx_pos += count;
+	return count;
 }
 
 /*
@@ -563,19 +633,23 @@ static int terminal_destroy(terminal* this)
 	Implementation:
 	- Use Linux signal file descriptors to receive signals. Currently,
 	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
+	  * SIGUSR1 is sent to wake up the PIC_daemon thread (e.g., to stop it).
 
 	  * SIGALRM is sent to indicate that some core timer has expired. This
 	    results to an interrupt on the core.
 
-	- Monitor these fds together with the fds of the terminals.
+	- Monitor these fds together with the fds of the terminals, with a
+	  persistent epoll instance. All fds are registered edge-triggered, and
+	  the terminal fds are also one-shot: they are re-armed by the cores
+	  when a transfer fails (see io_device). Thus, the cost of a loop 
+	  depends on the number of events, not on the number of devices.
 	
 	- At each loop dispatch interrupts as needed:
 	  * ALARM interrupts to those cores whose timer has expired
 	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
 	    an io_device which is now READY.		
+	  * SERIAL_RX/TX_READY for devices which have been inactive for
+	    SERIAL_TIMEOUT; this scan is done about once every SERIAL_TIMEOUT.
  */
 
 
@@ -621,97 +695,81 @@ static void close_signalfd(int sfd)
 
 /********************************
 
-	PIC loop state and helpers
+	PIC loop helpers
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
-
+/* The epoll tags of the signal fds; the terminal devices use 2*termno+iodir */
+#define PIC_TAG_ALARM 0xffffffffu
+#define PIC_TAG_USR1  0xfffffffeu
 
-static void pic_selector_reset(pic_selector* ps)
-{
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
-}
+/* The max number of events returned by one epoll_wait */
+#define PIC_MAX_EVENTS 64
 
 
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
+static void pic_add_signalfd(int sfd, uint32_t tag)
 {
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
+	struct epoll_event evt;
+	evt.events = EPOLLIN | EPOLLET;
+	evt.data.u64 = 0;
+	evt.data.u32 = tag;
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_ADD, sfd, &evt));
 }
 
 
-
-static int pic_select(pic_selector* ps)
+static void io_device_raise(io_device* dev, TimerDuration system_clock)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
+	dev->ready = 1;
+	dev->last_int = system_clock;
+	Core* core = (Core*) dev->int_core;
+
+	/* Record the port before raising, so that the handler will see it */
+	uint64_t port = 1ull << (dev->tag >> 1);
+	__atomic_fetch_or(& core->serial_pending[dev->iodir], port, __ATOMIC_RELEASE);
+	switch(dev->iodir) {
+		case IODIR_RX:
+			raise_interrupt(core, SERIAL_RX_READY); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
 	}
-	return selcode;
 }
 
 
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
-{
-	return FD_ISSET(fd, & ps->fds[dir]);
-}
-
-
-
-
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
+/*
+	Handle an epoll event on a device.
+ */
+static void pic_device_event(uint32_t tag, uint32_t events, TimerDuration system_clock)
 {
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
+	terminal* term = & TERM[tag >> 1];
+	io_device* dev = ((tag & 1)==IODIR_RX) ? & term->kbd : & term->con;
+
+	/* 
+		A disconnected device would be reported ready forever; it is not
+		re-armed, and it only gets the timeout interrupts from now on.
+	 */
+	if((events & (EPOLLHUP|EPOLLERR)) && !(events & (EPOLLIN|EPOLLOUT)))
+		dev->hangup = 1;
+	else
+		io_device_raise(dev, system_clock);
 }
 
 
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
+/*
+	Raise interrupts for devices that have been inactive for a while.
+ */
+static void pic_device_timeouts(TimerDuration system_clock)
 {
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
-	}
-}
-
-
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
-{
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
+	for(uint i=0; i<nterm; i++) {
+		terminal* term = & TERM[i];
+		if(system_clock - term->con.last_int > SERIAL_TIMEOUT)
+			io_device_raise(& term->con, system_clock);
+		if(system_clock - term->kbd.last_int > SERIAL_TIMEOUT)
+			io_device_raise(& term->kbd, system_clock);
 	}
 }
 
 
 
-
 static void PIC_daemon(void)
 {
 
@@ -723,6 +781,8 @@ static void PIC_daemon(void)
 	/* Open signal queues */
 	int sigusr1fd = open_signalfd(&sigusr1_set);
 	int sigalrmfd = open_signalfd(&sigalrm_set);
+	pic_add_signalfd(sigusr1fd, PIC_TAG_USR1);
+	pic_add_signalfd(sigalrmfd, PIC_TAG_ALARM);
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
@@ -730,48 +790,44 @@ static void PIC_daemon(void)
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
+
+	TimerDuration next_timeout_scan = get_coarse_time() + SERIAL_TIMEOUT;
 	
 	/* The PIC multiplexing loop */
 	while(PIC_active) {
 
-		pic_selector ps;
-
-		pic_selector_reset(&ps);
-
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
-
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
+		struct epoll_event events[PIC_MAX_EVENTS];
+		int nevents = epoll_wait(PIC_epfd, events, PIC_MAX_EVENTS, SERIAL_TIMEOUT/1000);
 
-		if(pic_select(&ps) == -1)
+		if(nevents == -1) {
+			if(errno != EINTR)  perror("PIC_epoll_wait: ");
 			continue;
+		}
 
 		PIC_loops++ ;
+		TimerDuration system_clock = get_coarse_time();
 
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
-			}
-		}
+		for(int e=0; e<nevents; e++) {
+			uint32_t tag = events[e].data.u32;
 
+			if(tag == PIC_TAG_ALARM) {
+				struct signalfd_siginfo sfdinfo;
 
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
+				while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
+					Core* core = & CORE[sfdinfo.ssi_int];
+					raise_interrupt(core, ALARM);
+				}
+			}
+			else if(tag == PIC_TAG_USR1)
+				drain_signalfd(sigusr1fd);
+			else
+				pic_device_event(tag, events[e].events, system_clock);
 		}
 
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
+		if(system_clock >= next_timeout_scan) {
+			pic_device_timeouts(system_clock);
+			next_timeout_scan = system_clock + SERIAL_TIMEOUT/2;
 		}
-
-
 	}
 
 
@@ -885,10 +941,14 @@ void vm_run(vm_config* vmc)
 	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
+	/* Create the PIC epoll instance */
+	PIC_epfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(PIC_epfd);
+
 	/* Initialize terminals */
 	nterm = vmc->serialno;
 	for(uint i=0; i<nterm; i++)
-		terminal_init(& TERM[i], vmc->serial_in[i], vmc->serial_out[i]);
+		terminal_init(& TERM[i], i, vmc->serial_in[i], vmc->serial_out[i]);
 
 	/* Init the cores */
 	ncores = vmc->cores;
@@ -899,6 +959,7 @@ void vm_run(vm_config* vmc)
 
 	/* Initialize the halted vector */
 	halt_vector = 0;
+	restart_vector = 0;
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -954,6 +1015,9 @@ void vm_run(vm_config* vmc)
 		CHECK(terminal_destroy(& TERM[i]));
 	nterm = 0;
 
+	CHECK(close(PIC_epfd));
+	PIC_epfd = -1;
+
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
 
@@ -990,11 +1054,26 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_physical_cores()
+{
+	return physical_cores;
+}
 
 
-void cpu_core_halt()
+
+/*
+	Halt the current core, until a signal arrives or the timeout
+	expires. A NULL timeout halts the core indefinitely.
+
+	A restart request that arrives before the halt bit is set is 
+	remembered in restart_vector, so that the core does not halt at all.
+ */
+static void core_halt(const struct timespec* timeout)
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	sigset_t oldmask;
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &oldmask));
+	int intr = core_interrupts_on;
+	core_interrupts_on = 0;
 
 	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
@@ -1004,42 +1083,70 @@ void cpu_core_halt()
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_SEQ_CST);
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-
-	/* Sleep for 10 msec */
-	int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-		
+	if(! (__atomic_load_n(& restart_vector, __ATOMIC_SEQ_CST) & cmask)) {
+		siginfo_t info;
+		int rc = (timeout==NULL) ? sigwaitinfo(&sigusr1_set, &info)
+			: sigtimedwait(&sigusr1_set, &info, timeout);
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		if(rc>0) {
+			/* Got signal, dispatch */
+			dispatch_interrupts(core);
+		}
+		else {
+			assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		}
 	}
 
 #if defined(CORE_STATISTICS)
-	/* Unset halt bit */
 	core->hlt_time += get_coarse_time()-stime0;
 #endif
 
-	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	/* Unset halt bit, we are running again */
+	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
+	__atomic_fetch_and(& restart_vector, ~cmask, __ATOMIC_SEQ_CST);
 
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	core_interrupts_on = intr;
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &oldmask, NULL));
+}
+
+
+void cpu_core_halt()
+{
+	/* Sleep for 10 msec */
+	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+	core_halt(&halt_time);
+}
+
+
+void cpu_core_halt_until(TimerDuration deadline)
+{
+	if(deadline == CPU_NO_DEADLINE) {
+		core_halt(NULL);
+		return;
+	}
+
+	TimerDuration now = get_coarse_time();
+	if(deadline <= now) return;
+
+	TimerDuration usec = deadline - now;
+	struct timespec halt_time = {
+		.tv_sec = usec / 1000000, .tv_nsec = (usec % 1000000) * 1000l
+	};
+	core_halt(&halt_time);
 }
 
 static int __core_restart(uint c)
 {
 	uint32_t cmask = 1 << c;
 
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_or(& restart_vector, cmask, __ATOMIC_SEQ_CST);
+	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
 	if( prevhv & cmask ) {
 		interrupt_core(CORE+c);
 #if defined(CORE_STATISTICS)		
@@ -1098,24 +1205,109 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return core_interrupts_on;
 }
 
 int cpu_disable_interrupts()
 {
 	sigset_t curss;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
+	core_interrupts_on = 0;
 	return sigismember(&curss, SIGUSR1)==0;
 }
 
 void cpu_enable_interrupts()
 {
+	core_interrupts_on = 1;
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 }
 
 
+#ifdef CPU_FAST_CONTEXT
+
+/*
+	The fast context switch for x86-64.
+
+	cpu_fast_switch(void** oldsp, void* newsp) pushes the callee-saved 
+	registers and the MXCSR and x87 control words on the current stack, 
+	stores the stack pointer into *oldsp, and does the reverse on newsp.
+
+	A new context starts at cpu_fast_trampoline, with the function to 
+	execute in %r12. The trampoline aligns the stack and calls it.
+ */
+void cpu_fast_switch(void** oldsp, void* newsp);
+void cpu_fast_trampoline(void);
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl cpu_fast_switch\n"
+	".type cpu_fast_switch, @function\n"
+	"cpu_fast_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_fast_switch, .-cpu_fast_switch\n"
+	"\n"
+	".p2align 4\n"
+	".globl cpu_fast_trampoline\n"
+	".type cpu_fast_trampoline, @function\n"
+	"cpu_fast_trampoline:\n"
+	"	andq $-16, %rsp\n"
+	"	call *%r12\n"
+	"	ud2\n"
+	".size cpu_fast_trampoline, .-cpu_fast_trampoline\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The initial frame, as it would be pushed by cpu_fast_switch */
+	struct {
+		uint32_t mxcsr, fpucw;
+		uint64_t r15, r14, r13, r12, rbx, rbp;
+		void* ret;
+		void* pad;
+	} *frame;
+
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	frame = (void*)(top - sizeof(*frame));
+	memset(frame, 0, sizeof(*frame));
+
+	frame->mxcsr = 0x1F80;		/* the default MXCSR */
+	frame->fpucw = 0x037F;		/* the default x87 control word */
+	frame->r12 = (uint64_t) ctx_func;
+	frame->ret = cpu_fast_trampoline;
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_fast_switch(&oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1138,6 +1330,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -1201,13 +1395,39 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the set of serial ports that raised 'intno' on the
+	current core.
+ */
+uint64_t bios_serial_pending(Interrupt intno)
+{
+	uint dir;
+	switch(intno) {
+		case SERIAL_RX_READY: dir = IODIR_RX; break;
+		case SERIAL_TX_READY: dir = IODIR_TX; break;
+		default: return 0;
+	}
+	return __atomic_exchange_n(& curr_core()->serial_pending[dir], 0, __ATOMIC_ACQUIRE);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return terminal_read(& TERM[serial], ptr, 1);
+}
+
+
+/*
+	Read up to 'size' bytes from serial port 'serial' into 'buf'. Return 
+	the number of bytes read, which is 0 if no data is available.
+ */
+uint bios_read_serial_buf(uint serial, char* buf, uint size)
+{
+	return terminal_read(& TERM[serial], buf, size);
 }
 
 
@@ -1217,7 +1437,17 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
+}
+
+
+/*
+	Write up to 'size' bytes from 'buf' to serial port 'serial'. Return 
+	the number of bytes written, which is 0 if the device is not ready.
+ */
+uint bios_write_serial_buf(uint serial, const char* buf, uint size)
+{
+	return io_device_write(& TERM[serial].con, buf, size);
 }
 
 
@@ -66,7 +66,7 @@
 
 	The virtual machine has a number of serial ports connected to terminals.
 
-	Each serial port/terminal can support reading and writing of single bytes.
+	Each serial port/terminal can support reading and writing of bytes.
 	The reads return keyboard input, whereas the writes send characters to display
 	on the screen.
 
@@ -85,12 +85,14 @@
 
 	./terminal 1
 
-	Data can be read from  a serial port, one byte at a time. A read
+	Data can be read from  a serial port, one byte at a time or many bytes
+	at a time (see @c bios_read_serial_buf). A read
 	may fail if the device is not-ready to perform the operation. On a device
 	which is ready, the read will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_RX_READY interrupt is raised.
 
-	Data can be written to a serial port, one byte at a time. A write
+	Data can be written to a serial port, one byte at a time or many bytes
+	at a time (see @c bios_write_serial_buf). A write
 	may fail if the device is not-ready to perform the operation. On a device
 	which is ready, the write will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_TX_READY interrupt is raised.
@@ -132,7 +134,7 @@ typedef enum Interrupt
 #define MAX_CORES 32
 
 /** @brief Maximum number of terminals for a virtual machine. */
-#define MAX_TERMINALS 4
+#define MAX_TERMINALS 64
 
 
 
@@ -302,6 +304,15 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of cores of the host machine.
+
+	Simulated cores beyond this number do not run in parallel with the
+	others, so it is not worth restarting them to share the load. 
+	@see cpu_core_restart_one
+ */
+uint cpu_physical_cores();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -378,14 +389,37 @@ void cpu_enable_interrupts();
 
 	This function is useful when a core becomes idle. An idle core does not
 	consume simulation resources (in particular CPU time).
+
+	The core is halted for at most 10 msec.
+	@see cpu_core_halt_until
 */
 void cpu_core_halt();
 
 
+/** @brief A deadline for @c cpu_core_halt_until that never expires. */
+#define CPU_NO_DEADLINE ((TimerDuration)-1)
+
+/**
+	@brief Halt the core until an interrupt arrives, or until a deadline.
+
+	This is like @c cpu_core_halt(), except that the core stays halted until
+	@c bios_clock() reaches @c deadline, or indefinitely if @c deadline is
+	@c CPU_NO_DEADLINE. The call returns at once if the deadline has passed.
+
+	A restart request (e.g., by @c cpu_core_restart()) for a core that 
+	is not halted yet is not lost: the next halt of the core returns
+	immediately.
+
+	@param deadline the time (as returned by @c bios_clock()) to wake up
+*/
+void cpu_core_halt_until(TimerDuration deadline);
+
+
 /**
 	@brief Restart the given core.
 
-	This call will restart the given core, if it was halted.
+	This call will restart the given core, if it was halted. If the core
+	is not halted, its next halt will return immediately.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -405,10 +439,37 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Use the fast context switch.
+
+	On x86-64, contexts are switched by a small assembly routine, which
+	saves and restores only the callee-saved registers (and the floating
+	point control words) on the thread's stack. Unlike @c swapcontext, it 
+	does not save or restore the signal mask, which saves a system call
+	on every switch. This is correct, because the kernel only switches
+	contexts with interrupts disabled.
+
+	Compile with @c -DCPU_UCONTEXT to use the portable @c ucontext 
+	implementation instead.
+*/
+#if defined(__x86_64__) && !defined(CPU_UCONTEXT)
+#define CPU_FAST_CONTEXT
+#endif
+
+#ifdef CPU_FAST_CONTEXT
+/**
+	@brief A type for saving CPU context into.
+
+	The registers are saved on the stack, so only the stack pointer
+	needs to be stored.
+*/
+typedef struct { void* sp; } cpu_context_t;
+#else
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -512,6 +573,26 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Return the serial ports that raised an interrupt on this core.
+
+	For each core, the bios records which serial ports have raised 
+	@c SERIAL_RX_READY and @c SERIAL_TX_READY interrupts on it. This call
+	returns the set of serial ports that have raised interrupt @c intno
+	on the current core (bit @f$ i @f$ is set for serial port @f$ i @f$),
+	and clears it. Thus, an interrupt handler can service only the ports
+	that need it.
+
+	A port is recorded before its interrupt is raised; therefore, a port
+	recorded after a call to this function will cause the handler to
+	be called again.
+
+	@param intno the interrupt, @c SERIAL_RX_READY or @c SERIAL_TX_READY
+	@returns a bitmap of serial ports, or 0 for other interrupts
+ */
+uint64_t bios_serial_pending(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -546,4 +627,45 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read many bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into @c buf.
+	This is like @c bios_read_serial, except that it transfers as many bytes
+	as are available. Input is read from the terminal in large chunks, which
+	are staged in a per-terminal buffer, so that reading many bytes (by either
+	call) costs a single system call of the host.
+
+	If this operation returns 0, a @c SERIAL_RX_READY interrupt will be raised when
+	data is ready to be received.
+
+	Calls to @c bios_read_serial and @c bios_read_serial_buf on the same serial
+	port must not be concurrent.
+
+	@param serial the serial device to read from
+	@param buf the buffer in which to store the read bytes
+	@param size the size of @c buf
+	@return the number of bytes read
+ */
+uint bios_read_serial_buf(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write many bytes to a serial port.
+
+	Try to write up to @c size bytes from @c buf to serial port @c serial, with
+	a single system call of the host. This is like @c bios_write_serial, except 
+	that it transfers as many bytes as the device accepts.
+
+	If this operation returns less than @c size, a @c SERIAL_TX_READY interrupt
+	will be raised when the device is ready to accept data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to write
+	@param size the number of bytes in @c buf
+	@return the number of bytes written
+ */
+uint bios_write_serial_buf(uint serial, const char* buf, uint size);
+
+
 #endif
@@ -0,0 +1,74 @@
+#include <bios.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+/*
+  A benchmark of the context switch.
+
+  Two contexts ping-pong on the same core, first with cpu_swap_context()
+  and then with swapcontext(), the way the bios switched contexts before
+  the fast context switch.
+ */
+
+#define SWITCHES 1000000
+#define STACK_SIZE (64*1024)
+
+static cpu_context_t main_ctx, ping_ctx;
+static ucontext_t main_uctx, ping_uctx;
+
+static void ping()
+{
+  while(1) cpu_swap_context(&ping_ctx, &main_ctx);
+}
+
+static void ping_u()
+{
+  while(1) swapcontext(&ping_uctx, &main_uctx);
+}
+
+static double elapsed(struct timespec* t0)
+{
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec)*1E9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+void bootfunc()
+{
+  struct timespec t0;
+  void* stack = malloc(STACK_SIZE);
+
+  /* cpu_swap_context */
+  cpu_initialize_context(&ping_ctx, stack, STACK_SIZE, ping);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(int i=0; i<SWITCHES; i++)
+    cpu_swap_context(&main_ctx, &ping_ctx);
+  double t_cpu = elapsed(&t0);
+
+  /* swapcontext with a full signal mask */
+  getcontext(&ping_uctx);
+  ping_uctx.uc_link = NULL;
+  ping_uctx.uc_stack.ss_sp = stack;
+  ping_uctx.uc_stack.ss_size = STACK_SIZE;
+  ping_uctx.uc_stack.ss_flags = 0;
+  sigfillset(&ping_uctx.uc_sigmask);
+  makecontext(&ping_uctx, ping_u, 0);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(int i=0; i<SWITCHES; i++)
+    swapcontext(&main_uctx, &ping_uctx);
+  double t_uc = elapsed(&t0);
+
+  free(stack);
+
+  printf("cpu_swap_context: %6.1f nsec per switch\n", t_cpu / (2*SWITCHES));
+  printf("swapcontext:      %6.1f nsec per switch\n", t_uc / (2*SWITCHES));
+}
+
+int main()
+{
+  vm_boot(bootfunc, 1, 0);
+  return 0;
+}
@@ -1,6 +1,7 @@
 
 
 #include <assert.h>
+#include <limits.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
@@ -23,57 +24,664 @@
  	Pre-emption aware mutex.
  	-------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	This mutex will act as a spinlock if preemption is off, and as an
+ 	adaptive blocking mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	The mutex is a single word. It is 0 when unlocked, else it holds the
+ 	TCB of the owner (or MUTEX_NOTHREAD, for idle threads and at boot), 
+ 	and the MUTEX_WAITERS bit if some thread may be parked on it.
+ 	In the preemptive domain, a contended lock spins only while the owner
+ 	is running on another core, else the thread parks in a wait queue.
+ 	A parked thread lends its priority to the owner, until the owner
+ 	unlocks the mutex (priority inheritance, see below).
+
+ 	The wait queues of all mutexes are kept in the hash table of wait 
+ 	queues (see below), so that MUTEX_INIT remains 0. A thread that is 
+ 	woken up competes for the lock again, and it sets MUTEX_WAITERS, 
+ 	since other threads may be parked behind it.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
+
+#define MUTEX_WAITERS ((Mutex) 1)
+#define MUTEX_NOTHREAD ((Mutex) 2)
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+/*
+	Wait queues.
+
+	Threads that block on a Mutex, an RWLock or a Semaphore are parked in
+	a hash table of FIFO wait queues, keyed by the address of the object.
+	Each waiter sleeps on its own state word, with sleep_on_word(), and it
+	is woken up by changing the word from WQ_WAITING to WQ_WOKEN with
+	wakeup_word(). A waiter that wakes up for another reason (a timeout)
+	cancels itself and leaves the queue.
+
+	A thread parks only if a check, made under the lock of the bucket,
+	succeeds. The check sets a 'waiters' bit in the object, only if the
+	object is still in the state that made the thread block, so that the
+	thread which releases the object will find the waiter in the queue.
+ */
+
+/** \cond HELPER Helper structures for parking threads. */
+typedef struct __wq_waiter {
+	struct __wq_waiter* next;	/* next in the wait queue */
+	void* key;					/* the object waited on */
+	int kind;					/* one of the WQ_EXCLUSIVE, WQ_SHARED values */
+	TCB* thread;				/* thread to wait */
+	volatile int state;			/* one of the WQ_WAITING ... values below */
+	TCB* lendee;				/* for a mutex, the owner it lends its priority to */
+	rlnode pi_node;				/* in lendee->pi_lenders */
+} __wq_waiter;
+
+enum { WQ_WAITING, WQ_WOKEN, WQ_CANCELLED };
+enum { WQ_EXCLUSIVE, WQ_SHARED };
+
+typedef struct {
+	Mutex lock;					/* a spinlock, taken with preemption off */
+	__wq_waiter* head;			/* the wait queue, in FIFO order */
+	__wq_waiter* tail;
+} __wq_bucket;
+/** \endcond */
+
+#define WQ_BUCKETS 64
+static __wq_bucket wq_buckets[WQ_BUCKETS];
+
+static inline __wq_bucket* wq_bucket(void* key)
+{
+	uintptr_t h = (uintptr_t) key;
+	h ^= h >> 7;
+	h ^= h >> 13;
+	return & wq_buckets[h % WQ_BUCKETS];
+}
+
+/* Unlink a waiter from the wait queue of its bucket, if it is there */
+static void wq_unlink(__wq_bucket* b, __wq_waiter* w)
+{
+	__wq_waiter* prev = NULL;
+	for(__wq_waiter* p = b->head; p != NULL; prev = p, p = p->next) {
+		if(p != w) continue;
+		if(prev) prev->next = p->next; else b->head = p->next;
+		if(b->tail == p) b->tail = prev;
+		return;
+	}
+}
+
+static void pi_leave(__wq_waiter* w);
+
+/*
+	Park the current thread on the wait queue of 'key', if 'check(w, arg)'
+	returns nonzero for its waiter 'w'. Return 1 if the thread was woken by
+	wq_wake(), 0 if it did not park, or if it timed out.
+ */
+static int wq_park(void* key, int kind, int (*check)(__wq_waiter*, uintptr_t), uintptr_t arg,
+	enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	__wq_bucket* b = wq_bucket(key);
+
+	int preempt = preempt_off;
+	__wq_waiter w = { .next = NULL, .key = key, .kind = kind,
+		.thread = cctx[cpu_core_id].current_thread, .state = WQ_WAITING,
+		.lendee = NULL };
+	rlnode_init(&w.pi_node, &w);
+
+	Mutex_Lock(&b->lock);
+
+	if(! check(&w, arg)) {
+		Mutex_Unlock(&b->lock);
+		if(preempt) preempt_on;
+		return 0;
+	}
+
+	if(b->tail) b->tail->next = &w; else b->head = &w;
+	b->tail = &w;
+
+	sleep_on_word(&w.state, WQ_WAITING, &b->lock, cause, timeout);
+
+	/* If we were not woken by wq_wake(), leave the queue */
+	int state = WQ_WAITING;
+	if(__atomic_compare_exchange_n(&w.state, &state, WQ_CANCELLED, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		Mutex_Lock(&b->lock);
+		wq_unlink(b, &w);
+		Mutex_Unlock(&b->lock);
+	}
+
+	/* The waiter is going away, stop lending its priority */
+	if(w.thread != NULL && w.thread->mutex_wait == &w)
+		pi_leave(&w);
+
+	if(preempt) preempt_on;
+	return state == WQ_WOKEN;
+}
+
+/*
+	Wake up at most 'max' threads of the given kind, parked on 'key', in 
+	FIFO order. The bucket lock must be held. Return the number woken.
+ */
+static int wq_wake(__wq_bucket* b, void* key, int kind, int max)
+{
+	int n = 0;
+	__wq_waiter* w = b->head;
+	while(w != NULL && n < max) {
+		__wq_waiter* next = w->next;
+		if(w->key == key && w->kind == kind) {
+			wq_unlink(b, w);
+			if(wakeup_word(w->thread, &w->state, WQ_WAITING, WQ_WOKEN))
+				n++;
+		}
+		w = next;
+	}
+	return n;
+}
+
+/* Return 1 if a thread of the given kind is parked on 'key'. The bucket lock must be held. */
+static int wq_waiting(__wq_bucket* b, void* key, int kind)
+{
+	for(__wq_waiter* w = b->head; w != NULL; w = w->next)
+		if(w->key == key && w->kind == kind)
+			return 1;
+	return 0;
+}
+
+/* Set 'bit' in '*word', only if the word is still equal to 'seen' */
+static inline int set_bit_if(volatile unsigned int* word, unsigned int seen, unsigned int bit)
+{
+	return __atomic_compare_exchange_n(word, &seen, seen | bit, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static inline void cpu_relax()
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+	__builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
+}
+
+
+/*
+	Priority inheritance.
+
+	Each thread parked on a mutex is linked, by its waiter, in the 
+	'pi_lenders' list of the mutex owner (its 'lendee'), and the owner 
+	is lent the highest priority among its lenders. The list spans all 
+	the contended mutexes that the owner holds, so that unlocking one of
+	them drops only the loans made through it.
+
+	A parked thread records its waiter in 'mutex_wait'. When its own 
+	priority changes by a loan, the change is passed on to the owner of
+	the mutex it waits for, and so on along the chain of owners.
+
+	When the owner of a mutex changes, the waiters still parked on it are
+	moved to the new owner, by the next thread that parks on the mutex,
+	or by the woken thread that takes it.
+
+	The lists, the 'lendee' and 'mutex_wait' links and the loans are 
+	protected by 'pi_lock', which is taken with preemption off, after the
+	lock of a wait queue bucket, and before the scheduler locks.
+ */
+
+static Mutex pi_lock = MUTEX_INIT;
+
+/* Bound the chain of owners, in case the owners deadlock in a cycle */
+#define PI_MAX_DEPTH 32
+
+/* Recompute the loan of 'tcb' from its lenders, and pass it on. pi_lock must be held. */
+static void pi_update(TCB* tcb)
+{
+	for(int depth = 0; tcb != NULL && depth < PI_MAX_DEPTH; depth++) {
+		int prio = -1;
+		for(rlnode* p = tcb->pi_lenders.next; p != &tcb->pi_lenders; p = p->next) {
+			int lent = sched_thread_priority(((__wq_waiter*) p->obj)->thread);
+			if(lent > prio) prio = lent;
+		}
+		if(prio == tcb->pi_priority)
+			return;
+
+		sched_lend_priority(tcb, prio);
+		tcb = (tcb->mutex_wait != NULL) ? tcb->mutex_wait->lendee : NULL;
+	}
+}
+
+/* Make waiter 'w' lend its priority to 'owner'. pi_lock must be held. */
+static void pi_lend(__wq_waiter* w, TCB* owner)
+{
+	TCB* old = w->lendee;
+	if(old == owner) return;
+
+	if(old != NULL) {
+		rlist_remove(&w->pi_node);
+		w->lendee = NULL;
+		pi_update(old);
+	}
+	rlist_push_back(&owner->pi_lenders, &w->pi_node);
+	w->lendee = owner;
+}
+
+/* 
+	Make the threads parked on mutex 'key' lend their priority to 'owner'.
+	The bucket lock and pi_lock must be held.
+ */
+static void pi_adopt(__wq_bucket* b, void* key, TCB* owner)
+{
+	for(__wq_waiter* w = b->head; w != NULL; w = w->next)
+		if(w->key == key)
+			pi_lend(w, owner);
+	pi_update(owner);
+}
+
+/* 
+	Stop the threads parked on mutex 'key' from lending their priority to
+	'owner'. The bucket lock must be held. Return 1 if the loan of 'owner' 
+	was lowered.
+ */
+static int pi_disown(__wq_bucket* b, void* key, TCB* owner)
+{
+	int lowered = 0;
+	Mutex_Lock(&pi_lock);
+	for(__wq_waiter* w = b->head; w != NULL; w = w->next)
+		if(w->key == key && w->lendee == owner) {
+			rlist_remove(&w->pi_node);
+			w->lendee = NULL;
+			lowered = 1;
+		}
+	if(lowered) {
+		int prio = owner->pi_priority;
+		pi_update(owner);
+		lowered = owner->pi_priority < prio;
+	}
+	Mutex_Unlock(&pi_lock);
+	return lowered;
+}
+
+/* A parked thread is leaving its waiter 'w' */
+static void pi_leave(__wq_waiter* w)
+{
+	Mutex_Lock(&pi_lock);
+	TCB* old = w->lendee;
+	if(old != NULL) {
+		rlist_remove(&w->pi_node);
+		w->lendee = NULL;
+		pi_update(old);
+	}
+	w->thread->mutex_wait = NULL;
+	Mutex_Unlock(&pi_lock);
+}
+
+
+/* The owner value of the caller */
+static inline Mutex mutex_self()
+{
+	TCB* tcb = cur_thread_fast();
+	return (tcb != NULL) ? (Mutex) tcb : MUTEX_NOTHREAD;
+}
+
+/* Return 1 if the owner in the mutex word is running on some core */
+static int mutex_owner_running(Mutex word)
+{
+	Mutex owner = word & ~MUTEX_WAITERS;
+	if(owner == MUTEX_NOTHREAD) return 1;
+	for(uint c=0; c<cpu_cores(); c++)
+		if((Mutex) cctx[c].current_thread == owner)
+			return 1;
+	return 0;
+}
+
+/*
+	The parking check of a mutex whose word was seen to be 'word': tell
+	the owner that we wait, unless it has released the lock, and lend it 
+	our priority, together with the threads already parked on the mutex.
+	The owner cannot finish unlocking while we hold the bucket lock.
+ */
+static int mutex_park_check(__wq_waiter* w, uintptr_t word)
+{
+	Mutex seen = word;
+	if(! __atomic_compare_exchange_n((Mutex*) w->key, &seen, seen | MUTEX_WAITERS, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 0;
+
+	if(w->thread == NULL)
+		return 1;
+
+	Mutex owner = seen & ~MUTEX_WAITERS;
+	Mutex_Lock(&pi_lock);
+	w->thread->mutex_wait = w;
+	if(owner != MUTEX_NOTHREAD) {
+		pi_lend(w, (TCB*) owner);
+		pi_adopt(wq_bucket(w->key), w->key, (TCB*) owner);
+	}
+	Mutex_Unlock(&pi_lock);
+	return 1;
+}
+
+/* 
+	Wake up the first thread parked on a mutex, which we just released.
+	Return 1 if our loan was lowered.
+ */
+static int mutex_unpark(Mutex* lock)
+{
+	__wq_bucket* b = wq_bucket(lock);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+	TCB* self = cctx[cpu_core_id].current_thread;
+	int lowered = (self != NULL) && pi_disown(b, lock, self);
+	wq_wake(b, lock, WQ_EXCLUSIVE, 1);
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+	return lowered;
+}
+
+/* We took a mutex after parking on it: the threads still parked lend us their priority */
+static void mutex_adopt(Mutex* lock)
+{
+	__wq_bucket* b = wq_bucket(lock);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+	TCB* self = cctx[cpu_core_id].current_thread;
+	if(self != NULL && wq_waiting(b, lock, WQ_EXCLUSIVE)) {
+		Mutex_Lock(&pi_lock);
+		pi_adopt(b, lock, self);
+		Mutex_Unlock(&pi_lock);
+	}
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+}
+
+
+void Mutex_Lock(Mutex* lock)
+{
+  Mutex self = mutex_self();
+  Mutex word = 0;
+  if(__atomic_compare_exchange_n(lock, &word, self, 0, 
+  		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  	return;
+
+  /* Contended */
+  int preemptive = cpu_interrupts_enabled();
+  Mutex waiters = 0;
+  int spin = MUTEX_SPINS;
+
+  while(1) {
+    word = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    if(word == 0) {
+      if(__atomic_compare_exchange_n(lock, &word, self | waiters, 0, 
+      		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      	if(waiters && self != MUTEX_NOTHREAD)
+      		mutex_adopt(lock);
+      	return;
       }
+      continue;
     }
+
+    if(!preemptive || (spin > 0 && mutex_owner_running(word))) {
+      cpu_relax();
+      spin--;
+      continue;
+    }
+
+    wq_park(lock, WQ_EXCLUSIVE, mutex_park_check, word, SCHED_MUTEX, NO_TIMEOUT);
+    waiters = MUTEX_WAITERS;
+    spin = MUTEX_SPINS;
   }
-#undef MUTEX_SPINS
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+  Mutex word = 0;
+  return __atomic_compare_exchange_n(lock, &word, mutex_self(), 0, 
+  	__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  /* The waiters of this mutex no longer lend us their priority */
+  if((__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) & MUTEX_WAITERS)
+  		&& mutex_unpark(lock))
+  	sched_check_preempt();
 }
 
+#undef MUTEX_SPINS
+
 
 /*
-	Condition variables.	
+	Reader-writer locks.
+
+	The lock is a single word, holding the number of readers (in units of
+	RW_READER), the RW_WRITER bit when a writer holds the lock, and bits
+	that tell if readers or writers may be parked on it.
+
+	Writers are preferred: a reader does not take the lock while writers
+	are parked, so that a steady stream of readers cannot starve them.
+	When the lock is released, the first parked writer is woken up, or 
+	else all parked readers are. The woken threads compete for the lock
+	again, and park again if they lose.
+ */
+
+#define RW_WRITER 1u
+#define RW_WWAIT  2u
+#define RW_RWAIT  4u
+#define RW_READER 8u
+#define RW_READERS(w) ((w) / RW_READER)
+
+static int rw_park_reader(__wq_waiter* w, uintptr_t seen)
+{
+	return set_bit_if((RWLock*) w->key, seen, RW_RWAIT);
+}
+
+static int rw_park_writer(__wq_waiter* w, uintptr_t seen)
+{
+	return set_bit_if((RWLock*) w->key, seen, RW_WWAIT);
+}
+
+/* Wake up the first parked writer, or else all parked readers */
+static void rw_unpark(RWLock* rw)
+{
+	__wq_bucket* b = wq_bucket(rw);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+
+	/* A woken writer still wants the lock, so RW_WWAIT stays on for it */
+	if(wq_wake(b, rw, WQ_EXCLUSIVE, 1) == 0) {
+		__atomic_fetch_and(rw, ~RW_WWAIT, __ATOMIC_RELAXED);
+		wq_wake(b, rw, WQ_SHARED, INT_MAX);
+	}
+	if(! wq_waiting(b, rw, WQ_SHARED))
+		__atomic_fetch_and(rw, ~RW_RWAIT, __ATOMIC_RELAXED);
+
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+}
+
+
+void RWLock_ReadLock(RWLock* rw)
+{
+	int preemptive = cpu_interrupts_enabled();
+	while(1) {
+		RWLock word = __atomic_load_n(rw, __ATOMIC_RELAXED);
+		if(! (word & (RW_WRITER|RW_WWAIT))) {
+			if(__atomic_compare_exchange_n(rw, &word, word + RW_READER, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		if(preemptive)
+			wq_park(rw, WQ_SHARED, rw_park_reader, word, SCHED_MUTEX, NO_TIMEOUT);
+		else
+			cpu_relax();
+	}
+}
+
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+	RWLock word = __atomic_sub_fetch(rw, RW_READER, __ATOMIC_RELEASE);
+	if(RW_READERS(word) == 0 && (word & (RW_WWAIT|RW_RWAIT)))
+		rw_unpark(rw);
+}
+
+
+void RWLock_WriteLock(RWLock* rw)
+{
+	int preemptive = cpu_interrupts_enabled();
+	while(1) {
+		RWLock word = __atomic_load_n(rw, __ATOMIC_RELAXED);
+		if(! (word & RW_WRITER) && RW_READERS(word) == 0) {
+			if(__atomic_compare_exchange_n(rw, &word, word | RW_WRITER, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		if(preemptive)
+			wq_park(rw, WQ_EXCLUSIVE, rw_park_writer, word, SCHED_MUTEX, NO_TIMEOUT);
+		else
+			cpu_relax();
+	}
+}
+
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+	RWLock word = __atomic_and_fetch(rw, ~RW_WRITER, __ATOMIC_RELEASE);
+	if(word & (RW_WWAIT|RW_RWAIT))
+		rw_unpark(rw);
+}
+
+
+/*
+	Semaphores.
+
+	The semaphore is a single word, holding the count (in units of 
+	SEM_UNIT) and the SEM_WAITERS bit, if threads may be parked on it.
+	A post wakes up one parked thread, which competes for the count again.
+ */
+
+#define SEM_WAITERS 1u
+#define SEM_UNIT 2u
+
+static int sem_park_check(__wq_waiter* w, uintptr_t seen)
+{
+	return set_bit_if((Semaphore*) w->key, seen, SEM_WAITERS);
+}
+
+/* Clear SEM_WAITERS if no thread is parked, after a timeout */
+static void sem_tidy(Semaphore* sem)
+{
+	__wq_bucket* b = wq_bucket(sem);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+	if(! wq_waiting(b, sem, WQ_EXCLUSIVE))
+		__atomic_fetch_and(sem, ~SEM_WAITERS, __ATOMIC_RELAXED);
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+}
+
+static int sem_wait(Semaphore* sem, TimerDuration timeout)
+{
+	TimerDuration deadline = (timeout == NO_TIMEOUT) ? NO_TIMEOUT 
+		: bios_clock() + timeout;
+	int preemptive = cpu_interrupts_enabled();
+
+	while(1) {
+		Semaphore word = __atomic_load_n(sem, __ATOMIC_RELAXED);
+		if(word >= SEM_UNIT) {
+			if(__atomic_compare_exchange_n(sem, &word, word - SEM_UNIT, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return 1;
+			continue;
+		}
+
+		TimerDuration left = NO_TIMEOUT;
+		if(deadline != NO_TIMEOUT) {
+			TimerDuration now = bios_clock();
+			if(now >= deadline) {
+				if(word & SEM_WAITERS) sem_tidy(sem);
+				return 0;
+			}
+			left = deadline - now;
+		}
+
+		if(preemptive)
+			wq_park(sem, WQ_EXCLUSIVE, sem_park_check, word, SCHED_USER, left);
+		else
+			cpu_relax();
+	}
+}
+
+
+void Sem_Wait(Semaphore* sem)
+{
+	sem_wait(sem, NO_TIMEOUT);
+}
+
+
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout)
+{
+	/* We have to translate timeout from msec to usec */
+	return sem_wait(sem, timeout*1000ul);
+}
+
+
+void Sem_Post(Semaphore* sem)
+{
+	if(! (__atomic_fetch_add(sem, SEM_UNIT, __ATOMIC_RELEASE) & SEM_WAITERS))
+		return;
+
+	__wq_bucket* b = wq_bucket(sem);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+	wq_wake(b, sem, WQ_EXCLUSIVE, 1);
+	if(! wq_waiting(b, sem, WQ_EXCLUSIVE))
+		__atomic_fetch_and(sem, ~SEM_WAITERS, __ATOMIC_RELAXED);
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Condition variables.
+
+	A waiter does not take any lock to join a condition variable. It
+	pushes itself on cv->arrivals, which is a lock-free stack (of multiple 
+	producers), and sleeps on its own state word, with sleep_on_word().
+
+	Signalling threads are the single consumer: holding cv->waitset_lock,
+	they move the arrivals, in FIFO order, to the end of the ring 
+	cv->waitset, and then pop waiters from the front of the ring. 
+	A waiter is signalled by changing its state from CV_WAITING to 
+	CV_SIGNALLED with wakeup_word(), which also hands the thread off to
+	the core of the signaller.
+
+	A waiter that wakes up for some other reason (e.g., a timeout) cancels 
+	itself by changing its state to CV_CANCELLED. Because the waiter lives
+	on the stack of its thread, a cancelled waiter must make sure that it 
+	is not in the arrivals or the ring, before it returns.
 */
 
 
 /** \cond HELPER Helper structure for condition variables. */
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
+	struct __cv_waiter* next;	/* link in the arrivals stack */
 	TCB* thread;				/* thread to wait */
-	sig_atomic_t signalled;		/* this is set if the thread is signalled */
-	sig_atomic_t removed;		/* this is set if the waiter is removed 
+	volatile int state;			/* one of the CV_* values below */
+	int removed;				/* this is set if the waiter is removed 
 								   from the ring */
 } __cv_waiter;
+
+enum { CV_WAITING, CV_SIGNALLED, CV_CANCELLED };
 /** \endcond */
 
 /**
@@ -91,6 +699,37 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 }
 
 
+/**
+   @internal
+   A helper routine to move the arrivals of a CondVar to the end of
+   its ring, in the order they arrived. It must be called while holding
+   cv->waitset_lock.
+ */
+static void cv_take_arrivals(CondVar* cv)
+{
+	__cv_waiter* w = __atomic_exchange_n((__cv_waiter**) &cv->arrivals, NULL, 
+		__ATOMIC_ACQUIRE);
+
+	/* The stack is in reverse order */
+	__cv_waiter* fifo = NULL;
+	while(w) {
+		__cv_waiter* next = w->next;
+		w->next = fifo;
+		fifo = w;
+		w = next;
+	}
+
+	for(; fifo; fifo = fifo->next) {
+		if(cv->waitset) {
+			__cv_waiter* wset = cv->waitset;
+			rlist_push_back(& wset->node, & fifo->node);
+		} else {
+			cv->waitset = fifo;
+		}
+	}
+}
+
+
 /** 
    @internal
    @brief Wait on a condition variable, specifying the cause. 
@@ -121,41 +760,40 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .state=CV_WAITING, .removed=0 };
 	rlnode_init(& waiter.node, &waiter);
 
-	Mutex_Lock(&(cv->waitset_lock));
-	/* We just push the current thread to the back of the list */
-	if(cv->waitset) {
-		__cv_waiter* wset = cv->waitset;
-		rlist_push_back(& wset->node, & waiter.node);
-	} else {
-		cv->waitset = &waiter;
-	}
-
-	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
-	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
-
-	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
-	if(! waiter.removed) {
-		assert(! waiter.signalled);
-
-		/* We must remove ourselves from the ring! */
-		remove_from_ring(cv, &waiter);
+	/* Push ourselves on the arrivals */
+	waiter.next = __atomic_load_n((__cv_waiter**) &cv->arrivals, __ATOMIC_RELAXED);
+	while(! __atomic_compare_exchange_n((__cv_waiter**) &cv->arrivals, &waiter.next,
+			&waiter, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* Now atomically release mutex and sleep, unless already signalled */
+	sleep_on_word(&waiter.state, CV_WAITING, mutex, cause, timeout);
+
+	/* Woke up, if we were not signalled we must cancel, and tidy up */
+	int state = CV_WAITING;
+	if(__atomic_compare_exchange_n(&waiter.state, &state, CV_CANCELLED, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		Mutex_Lock(&(cv->waitset_lock));
+		cv_take_arrivals(cv);
+		if(! waiter.removed) {
+			/* We must remove ourselves from the ring! */
+			remove_from_ring(cv, &waiter);
+		}
+		Mutex_Unlock(&(cv->waitset_lock));
+		state = CV_CANCELLED;
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
 
 	Mutex_Lock(mutex);
-	return waiter.signalled;
+	return state == CV_SIGNALLED;
 }
 
 
 /**
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
-  will actually find a waiter to signal, if one exists. 
+  will actually find a waiter in the ring to signal, if one exists. 
   Else, it leaves the cv->waitset == NULL.
  */
 static inline void cv_signal(CondVar* cv)
@@ -165,10 +803,8 @@ static inline void cv_signal(CondVar* cv)
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
-			waiter->signalled = 1;
+		if(wakeup_word(waiter->thread, &waiter->state, CV_WAITING, CV_SIGNALLED))
 			return;
-		}
 	}
 }
 
@@ -189,6 +825,7 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 void Cond_Signal(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
+  cv_take_arrivals(cv);
   cv_signal(cv);
   Mutex_Unlock(&(cv->waitset_lock));
 }
@@ -197,6 +834,7 @@ void Cond_Signal(CondVar* cv)
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
+  cv_take_arrivals(cv);
   while(cv->waitset) cv_signal(cv);
   Mutex_Unlock(&(cv->waitset_lock));
 }
@@ -207,65 +845,14 @@ void Cond_Broadcast(CondVar* cv)
 
 /*
  *
- * The kernel locks
+ * Kernel synchronization
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
- */
-
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +865,7 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_sleep(Mutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	sleep_releasing(newstate, mx, cause, NO_TIMEOUT);
 }
-
-
-
-
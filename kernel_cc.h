@@ -32,32 +32,40 @@
 
 
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
- */
-
 /**
-	@brief Lock the kernel.
+	@brief Try to lock a mutex without waiting.
+
+	This is used in the scheduler, where a core must not spin on a lock
+	held by another core, when it has something better to do.
+
+	@returns 1 if the mutex was locked, 0 if it was already locked
  */
-void kernel_lock();
+int Mutex_TryLock(Mutex* lock);
 
-/**
-	@brief Unlock the kernel.
+
+/*
+ * Kernel synchronization.
+ *
+ * There is no global kernel lock. Each kernel subsystem protects its
+ * data with its own Mutex (e.g., the process table, the file table,
+ * the FIDT of each process, each device). These are wrappers for
+ * waiting on a condition while holding such a lock.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing a kernel lock.
+
+	The lock @c mx must be held by the caller. It is released while the
+	thread sleeps and it is held again when this call returns.
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -73,12 +81,12 @@ void kernel_broadcast(CondVar* cv);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, unlocking a kernel lock.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	The lock @c mx (if not NULL) is released atomically with the thread
+	going to sleep. It is not held again when the thread wakes up.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(Mutex* mx, Thread_state state, enum SCHED_CAUSE cause);
 
 
 
@@ -66,10 +66,18 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/* The size of the output queue of a terminal (a power of 2) */
+#define SERIAL_TX_SIZE 4096
+
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  Mutex spinlock;       /* Serializes readers with the rx interrupt */
   CondVar rx_ready;
+
+  Mutex tx_lock;        /* Serializes writers with the tx interrupt */
+  CondVar tx_space;     /* Writers wait here when the queue is full */
+  uint tx_head, tx_tail;  /* Free-running positions of the output queue */
+  char tx_queue[SERIAL_TX_SIZE];
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -84,13 +92,14 @@ void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
-    serial_dcb_t* dcb = &serial_dcb[i];
-    Cond_Broadcast(&dcb->rx_ready);
+  /* Signal only the terminals which raised the interrupt */
+  uint64_t ports = bios_serial_pending(SERIAL_RX_READY);
+  while(ports) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctzll(ports)];
+    ports &= ports-1;
+    Mutex_Lock(&dcb->spinlock);
+    kernel_broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
@@ -101,23 +110,22 @@ void serial_rx_handler()
 int serial_read(void* dev, char *buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  if(size == 0) return 0;
 
   preempt_off;            /* Stop preemption */
 
-  uint count =  0;
+  /* 
+    The rx interrupt handler takes the lock too, so that it cannot 
+    signal between a failed read and our going to sleep.
+   */
+  Mutex_Lock(&dcb->spinlock);
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
-    }
-    else
-      break;
-  }
+  uint count;
+
+  while((count = bios_read_serial_buf(dcb->devno, buf, size)) == 0)
+    kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
+
+  Mutex_Unlock(&dcb->spinlock);
 
   preempt_on;           /* Restart preemption */
 
@@ -126,37 +134,77 @@ int serial_read(void* dev, char *buf, unsigned int size)
 
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial-device writes.
+
+  Writers put data in the output queue of the terminal, and send as much
+  of it as the device accepts. The rest is sent by the tx interrupt
+  handler, when the device becomes ready. Writers only block when the 
+  queue is full.
+ */
+
+/* Send queued data to the device, until the queue is empty or the 
+   device is not ready. The tx_lock must be held. */
+static void serial_tx_flush(serial_dcb_t* dcb)
+{
+  int was_full = (dcb->tx_head - dcb->tx_tail == SERIAL_TX_SIZE);
+
+  while(dcb->tx_head != dcb->tx_tail) {
+    uint pos = dcb->tx_tail & (SERIAL_TX_SIZE-1);
+    uint len = dcb->tx_head - dcb->tx_tail;
+    if(len > SERIAL_TX_SIZE - pos) len = SERIAL_TX_SIZE - pos;
+
+    uint sent = bios_write_serial_buf(dcb->devno, dcb->tx_queue + pos, len);
+    dcb->tx_tail += sent;
+    if(sent < len) break;
+  }
+
+  if(was_full && dcb->tx_head - dcb->tx_tail < SERIAL_TX_SIZE)
+    kernel_broadcast(&dcb->tx_space);
+}
 
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  uint64_t ports = bios_serial_pending(SERIAL_TX_READY);
+  while(ports) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctzll(ports)];
+    ports &= ports-1;
+    Mutex_Lock(&dcb->tx_lock);
+    serial_tx_flush(dcb);
+    Mutex_Unlock(&dcb->tx_lock);
+  }
+  if(pre) preempt_on;
 }
 
 /* 
   Write call 
-  This is currently a polling driver.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  if(size == 0) return 0;
 
-  unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
+  preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->tx_lock);
 
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
-    }
-    else
-      break;
-  }
+  while(dcb->tx_head - dcb->tx_tail == SERIAL_TX_SIZE)
+    kernel_wait(&dcb->tx_lock, &dcb->tx_space, SCHED_IO);
+
+  /* Queue as much as fits, in (at most) two segments */
+  uint space = SERIAL_TX_SIZE - (dcb->tx_head - dcb->tx_tail);
+  uint count = (size < space) ? size : space;
+  uint pos = dcb->tx_head & (SERIAL_TX_SIZE-1);
+  uint first = (count < SERIAL_TX_SIZE - pos) ? count : SERIAL_TX_SIZE - pos;
+  memcpy(dcb->tx_queue + pos, buf, first);
+  memcpy(dcb->tx_queue, buf + first, count - first);
+  dcb->tx_head += count;
+
+  serial_tx_flush(dcb);
+
+  Mutex_Unlock(&dcb->tx_lock);
+  preempt_on;           /* Restart preemption */
 
   return count;  
 }
@@ -211,6 +259,9 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_lock = MUTEX_INIT;
+    serial_dcb[i].tx_space = COND_INIT;
+    serial_dcb[i].tx_head = serial_dcb[i].tx_tail = 0;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -218,6 +269,32 @@ void initialize_devices()
 }
 
 
+/* How long to try sending queued output at shutdown (usec) */
+#define SERIAL_DRAIN_TIMEOUT 2000000
+
+void finalize_devices()
+{
+  /* Send the output still queued, unless a terminal is stuck */
+  TimerDuration deadline = bios_clock() + SERIAL_DRAIN_TIMEOUT;
+  for(int i=0; i<bios_serial_ports(); i++) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    while(dcb->tx_head != dcb->tx_tail && bios_clock() < deadline) {
+      int pre = preempt_off;
+      Mutex_Lock(&dcb->tx_lock);
+      serial_tx_flush(dcb);
+      Mutex_Unlock(&dcb->tx_lock);
+      if(pre) preempt_on;
+
+      if(dcb->tx_head != dcb->tx_tail) 
+        cpu_core_halt_until(deadline);
+    }
+  }
+
+  cpu_interrupt_handler(SERIAL_RX_READY, NULL);
+  cpu_interrupt_handler(SERIAL_TX_READY, NULL);
+}
+
+
 int device_open(Device_type major, uint minor, void** obj, file_ops** ops)
 {
   assert(major < DEV_MAX);  
@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -81,6 +82,22 @@ typedef struct file_operations {
   */
     int (*Write)(void* this, const char* buf, unsigned int size);
 
+  /** @brief Vectored read operation (optional).
+
+    Read into the 'iovcnt' buffers of 'iov', filling each buffer before
+    the next. The semantics are those of Read, over the total size of
+    the buffers. If this is NULL, the kernel falls back to Read.
+  */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+  /** @brief Vectored write operation (optional).
+
+    Write from the 'iovcnt' buffers of 'iov', in order. The semantics
+    are those of Write, over the total size of the buffers. If this is
+    NULL, the kernel falls back to Write.
+  */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
     /** @brief Close operation.
 
       Close the stream object, deallocating any resources held by it.
@@ -136,6 +153,14 @@ typedef struct device_control_block
  */
 void initialize_devices();
 
+/** 
+  @brief Finalization for devices.
+
+  This function is called at kernel shutdown, after the scheduler
+  has stopped. It sends any output still queued for the terminals.
+ */
+void finalize_devices();
+
 
 /**
   @brief Open a device.
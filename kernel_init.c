@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_socket.h"
 
 
 
@@ -26,6 +27,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  boot_options opts;
 } boot_rec;
 
 
@@ -38,7 +40,8 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_sockets();
+    initialize_scheduler(&boot_rec.opts);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -54,21 +57,31 @@ void boot_tinyos_kernel()
   run_scheduler();
 
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* Cleanup after the scheduler has ended. */    
+    finalize_devices();
   }
 }
 
 
-void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+void boot_with_options(uint ncores, uint nterm, Task boot_task, int argl, void* args,
+  const boot_options* opts)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
+  boot_rec.opts = *opts;
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
 }
 
 
+void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_options opts = BOOT_OPTIONS_DEFAULT;
+  boot_with_options(ncores, nterm, boot_task, argl, args, &opts);
+}
+
+
 
 
 
@@ -1,9 +1,298 @@
 
 #include "tinyos.h"
+#include "kernel_pipe.h"
+#include "kernel_socket.h"
 
 
-int sys_Pipe(pipe_t* pipe)
+pipe_cb* pipe_create(unsigned int size)
+{
+	if(size == 0)
+		size = PIPE_BUFFER_SIZE;
+
+	/* Round up to a power of 2 */
+	unsigned int bufsize = PIPE_MIN_SIZE;
+	while(bufsize < size && bufsize < PIPE_MAX_SIZE)
+		bufsize <<= 1;
+
+	pipe_cb* pipe = xmalloc(sizeof(pipe_cb) + bufsize);
+	pipe->lock = MUTEX_INIT;
+	pipe->has_data = COND_INIT;
+	pipe->has_space = COND_INIT;
+	pipe->reader_open = 1;
+	pipe->writer_open = 1;
+	pipe->refcount = 2;
+	pipe->r_pos = 0;
+	pipe->w_pos = 0;
+	pipe->size = bufsize;
+	return pipe;
+}
+
+
+/* Release an end of the pipe, and free it when both ends are released */
+static void pipe_release(pipe_cb* pipe)
+{
+	if(__atomic_sub_fetch(&pipe->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(pipe);
+}
+
+
+/* Copy n bytes out of the ring, in (at most) two segments */
+static void ring_get(pipe_cb* pipe, char* buf, unsigned int n)
+{
+	unsigned int pos = pipe->r_pos & (pipe->size-1);
+	unsigned int first = pipe->size - pos;
+	if(first > n) first = n;
+	memcpy(buf, pipe->buffer + pos, first);
+	memcpy(buf + first, pipe->buffer, n - first);
+	pipe->r_pos += n;
+}
+
+/* Copy n bytes into the ring, in (at most) two segments */
+static void ring_put(pipe_cb* pipe, const char* buf, unsigned int n)
+{
+	unsigned int pos = pipe->w_pos & (pipe->size-1);
+	unsigned int first = pipe->size - pos;
+	if(first > n) first = n;
+	memcpy(pipe->buffer + pos, buf, first);
+	memcpy(pipe->buffer, buf + first, n - first);
+	pipe->w_pos += n;
+}
+
+
+int pipe_readv(void* pipecb, const iovec_t* iov, unsigned int iovcnt)
+{
+	pipe_cb* pipe = pipecb;
+
+	Mutex_Lock(&pipe->lock);
+	while(pipe->w_pos == pipe->r_pos && pipe->writer_open && pipe->reader_open)
+		kernel_wait(&pipe->lock, &pipe->has_data, SCHED_PIPE);
+
+	if(! pipe->reader_open) {
+		Mutex_Unlock(&pipe->lock);
+		return -1;
+	}
+
+	unsigned int count = pipe->w_pos - pipe->r_pos;
+	unsigned int n = 0;
+	for(unsigned int i=0; i<iovcnt && n<count; i++) {
+		unsigned int len = iov[i].len;
+		if(len > count-n) len = count-n;
+		ring_get(pipe, iov[i].base, len);
+		n += len;
+	}
+
+	if(count == pipe->size && n > 0)
+		kernel_broadcast(&pipe->has_space);
+
+	Mutex_Unlock(&pipe->lock);
+	return n;
+}
+
+
+int pipe_writev(void* pipecb, const iovec_t* iov, unsigned int iovcnt)
+{
+	pipe_cb* pipe = pipecb;
+
+	Mutex_Lock(&pipe->lock);
+	while(pipe->w_pos - pipe->r_pos == pipe->size && pipe->reader_open && pipe->writer_open)
+		kernel_wait(&pipe->lock, &pipe->has_space, SCHED_PIPE);
+
+	if(! pipe->reader_open || ! pipe->writer_open) {
+		Mutex_Unlock(&pipe->lock);
+		return -1;
+	}
+
+	unsigned int count = pipe->w_pos - pipe->r_pos;
+	unsigned int space = pipe->size - count;
+	unsigned int n = 0;
+	for(unsigned int i=0; i<iovcnt && n<space; i++) {
+		unsigned int len = iov[i].len;
+		if(len > space-n) len = space-n;
+		ring_put(pipe, iov[i].base, len);
+		n += len;
+	}
+
+	if(count == 0 && n > 0)
+		kernel_broadcast(&pipe->has_data);
+
+	Mutex_Unlock(&pipe->lock);
+	return n;
+}
+
+
+int pipe_read(void* pipecb, char* buf, unsigned int n)
+{
+	iovec_t iov = { .base = buf, .len = n };
+	return pipe_readv(pipecb, &iov, 1);
+}
+
+
+int pipe_write(void* pipecb, const char* buf, unsigned int n)
+{
+	iovec_t iov = { .base = (char*) buf, .len = n };
+	return pipe_writev(pipecb, &iov, 1);
+}
+
+
+void pipe_shut_reader(pipe_cb* pipe)
+{
+	Mutex_Lock(&pipe->lock);
+	pipe->reader_open = 0;
+	kernel_broadcast(&pipe->has_data);
+	kernel_broadcast(&pipe->has_space);
+	Mutex_Unlock(&pipe->lock);
+}
+
+
+void pipe_shut_writer(pipe_cb* pipe)
+{
+	Mutex_Lock(&pipe->lock);
+	pipe->writer_open = 0;
+	kernel_broadcast(&pipe->has_data);
+	kernel_broadcast(&pipe->has_space);
+	Mutex_Unlock(&pipe->lock);
+}
+
+
+int pipe_reader_close(void* pipecb)
+{
+	pipe_shut_reader(pipecb);
+	pipe_release(pipecb);
+	return 0;
+}
+
+
+int pipe_writer_close(void* pipecb)
+{
+	pipe_shut_writer(pipecb);
+	pipe_release(pipecb);
+	return 0;
+}
+
+
+int pipe_splice(pipe_cb* src, pipe_cb* dst, unsigned int n)
+{
+	assert(src != dst);
+	pipe_cb* first_lock = (src < dst) ? src : dst;
+	pipe_cb* second_lock = (src < dst) ? dst : src;
+
+	while(1) {
+		/* Wait for data, then for space, holding one lock at a time */
+		Mutex_Lock(&src->lock);
+		while(src->w_pos == src->r_pos && src->writer_open && src->reader_open)
+			kernel_wait(&src->lock, &src->has_data, SCHED_PIPE);
+		int shut = !src->reader_open;
+		int eof = (src->w_pos == src->r_pos);
+		Mutex_Unlock(&src->lock);
+		if(shut) return -1;
+		if(eof) return 0;
+
+		Mutex_Lock(&dst->lock);
+		while(dst->w_pos - dst->r_pos == dst->size && dst->reader_open && dst->writer_open)
+			kernel_wait(&dst->lock, &dst->has_space, SCHED_PIPE);
+		int broken = !dst->reader_open || !dst->writer_open;
+		Mutex_Unlock(&dst->lock);
+		if(broken) return -1;
+
+		Mutex_Lock(&first_lock->lock);
+		Mutex_Lock(&second_lock->lock);
+
+		if(! src->reader_open || ! dst->reader_open || ! dst->writer_open) {
+			Mutex_Unlock(&second_lock->lock);
+			Mutex_Unlock(&first_lock->lock);
+			return -1;
+		}
+
+		unsigned int count = src->w_pos - src->r_pos;
+		unsigned int dcount = dst->w_pos - dst->r_pos;
+		unsigned int m = n;
+		if(m > count) m = count;
+		if(m > dst->size - dcount) m = dst->size - dcount;
+
+		if(m > 0) {
+			/* Copy segment by segment, bounded by the ends of both rings */
+			for(unsigned int left = m; left > 0; ) {
+				unsigned int spos = src->r_pos & (src->size-1);
+				unsigned int dpos = dst->w_pos & (dst->size-1);
+				unsigned int chunk = left;
+				if(chunk > src->size - spos) chunk = src->size - spos;
+				if(chunk > dst->size - dpos) chunk = dst->size - dpos;
+				memcpy(dst->buffer + dpos, src->buffer + spos, chunk);
+				src->r_pos += chunk;
+				dst->w_pos += chunk;
+				left -= chunk;
+			}
+
+			if(count == src->size)
+				kernel_broadcast(&src->has_space);
+			if(dcount == 0)
+				kernel_broadcast(&dst->has_data);
+		}
+
+		Mutex_Unlock(&second_lock->lock);
+		Mutex_Unlock(&first_lock->lock);
+
+		/* Another thread may have taken the data or the space; retry */
+		if(m > 0) return m;
+	}
+}
+
+
+static file_ops pipe_reader_ops = {
+	.Open = NULL,
+	.Read = pipe_read,
+	.Write = NULL,
+	.ReadV = pipe_readv,
+	.Close = pipe_reader_close
+};
+
+static file_ops pipe_writer_ops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = pipe_write,
+	.WriteV = pipe_writev,
+	.Close = pipe_writer_close
+};
+
+
+pipe_cb* pipe_source(FCB* fcb)
+{
+	if(fcb->streamfunc == &pipe_reader_ops)
+		return fcb->streamobj;
+	return socket_read_pipe(fcb);
+}
+
+
+pipe_cb* pipe_sink(FCB* fcb)
 {
-	return -1;
+	if(fcb->streamfunc == &pipe_writer_ops)
+		return fcb->streamobj;
+	return socket_write_pipe(fcb);
 }
 
+
+int sys_SizedPipe(pipe_t* pipe, unsigned int size)
+{
+	Fid_t fid[2];
+	FCB* fcb[2];
+
+	if(! FCB_reserve(2, fid, fcb))
+		return -1;
+
+	pipe_cb* p = pipe_create(size);
+
+	fcb[0]->streamobj = p;
+	fcb[0]->streamfunc = &pipe_reader_ops;
+	fcb[1]->streamobj = p;
+	fcb[1]->streamfunc = &pipe_writer_ops;
+
+	pipe->read = fid[0];
+	pipe->write = fid[1];
+	return 0;
+}
+
+
+int sys_Pipe(pipe_t* pipe)
+{
+	return sys_SizedPipe(pipe, PIPE_BUFFER_SIZE);
+}
@@ -0,0 +1,178 @@
+#ifndef __KERNEL_PIPE_H
+#define __KERNEL_PIPE_H
+
+/**
+	@file kernel_pipe.h
+	@brief Pipes.
+
+	@defgroup pipes Pipes
+	@ingroup kernel
+	@brief Pipes.
+
+	A pipe is a one-directional byte stream, kept in a ring buffer whose
+	size is a power of two. The read and write positions are free-running
+	counters, therefore the number of bytes in the buffer is always
+	@c w_pos-r_pos, and the buffer index of a position is @c pos&(size-1).
+	Data is moved in and out of the buffer with (at most two) bulk copies.
+
+	Readers sleep on @c has_data and writers on @c has_space. These are
+	only signalled when the buffer goes from empty to non-empty and from
+	full to non-full respectively, or when an end is closed.
+
+	Pipe control blocks are also used by the kernel without FCBs (e.g.,
+	by sockets), through @c pipe_create() and the pipe_* functions.
+	An end can be shut down (@c pipe_shut_reader(), @c pipe_shut_writer())
+	while other threads may still use it; the pipe is freed only when both
+	ends have been closed, which releases them.
+
+	@{
+*/
+
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+
+/** @brief The default pipe buffer size (in bytes). */
+#define PIPE_BUFFER_SIZE 8192
+
+/** @brief The smallest pipe buffer size (in bytes). */
+#define PIPE_MIN_SIZE 512
+
+/** @brief The largest pipe buffer size (in bytes). */
+#define PIPE_MAX_SIZE (1024*1024)
+
+/** @brief The pipe control block. */
+typedef struct pipe_control_block {
+	Mutex lock;				/**< @brief Protects the pipe */
+	CondVar has_data;		/**< @brief Readers wait for data here */
+	CondVar has_space;		/**< @brief Writers wait for space here */
+
+	int reader_open;		/**< @brief The read end is open */
+	int writer_open;		/**< @brief The write end is open */
+	unsigned int refcount;	/**< @brief The ends that are not closed yet */
+
+	unsigned int r_pos;		/**< @brief Total bytes read so far */
+	unsigned int w_pos;		/**< @brief Total bytes written so far */
+	unsigned int size;		/**< @brief The buffer size, a power of 2 */
+	char buffer[];			/**< @brief The ring buffer */
+} pipe_cb;
+
+
+/**
+	@brief Create a pipe control block.
+
+	The requested size is rounded up to a power of two, within
+	@c PIPE_MIN_SIZE and @c PIPE_MAX_SIZE. A size of 0 selects
+	@c PIPE_BUFFER_SIZE. Both ends of the new pipe are open.
+
+	@param size the requested buffer size
+	@returns the new pipe control block
+*/
+pipe_cb* pipe_create(unsigned int size);
+
+/**
+	@brief Read from a pipe.
+
+	Block until there is data in the pipe or the write end is closed,
+	and then read up to @c n bytes.
+
+	@returns the number of bytes read, 0 if the pipe is empty and its
+	write end is closed, or -1 if the read end is shut down.
+*/
+int pipe_read(void* pipecb, char* buf, unsigned int n);
+
+/**
+	@brief Write to a pipe.
+
+	Block until there is space in the pipe or the read end is closed,
+	and then write up to @c n bytes.
+
+	@returns the number of bytes written, or -1 if either end is closed.
+*/
+int pipe_write(void* pipecb, const char* buf, unsigned int n);
+
+/**
+	@brief Read from a pipe into several buffers.
+
+	This is like @c pipe_read, except that the data is placed in the
+	buffers of @c iov, in order, under a single acquisition of the pipe lock.
+*/
+int pipe_readv(void* pipecb, const iovec_t* iov, unsigned int iovcnt);
+
+/**
+	@brief Write to a pipe from several buffers.
+
+	This is like @c pipe_write, except that the data is taken from the
+	buffers of @c iov, in order, under a single acquisition of the pipe lock.
+*/
+int pipe_writev(void* pipecb, const iovec_t* iov, unsigned int iovcnt);
+
+/**
+	@brief Shut down the read end of a pipe.
+
+	Threads blocked on the pipe are woken up. Later reads fail and writes
+	fail. The pipe is not released, so that threads that use the read end
+	concurrently can still access it. Shutting down an end again has no
+	effect.
+*/
+void pipe_shut_reader(pipe_cb* pipe);
+
+/**
+	@brief Shut down the write end of a pipe.
+
+	Threads blocked on the pipe are woken up. Later writes fail, and
+	reads return 0 when the pipe is empty.
+	@see pipe_shut_reader
+*/
+void pipe_shut_writer(pipe_cb* pipe);
+
+/**
+	@brief Close the read end of a pipe.
+
+	The end is shut down (if it was not already) and released. The pipe
+	is freed when both ends are closed. No other thread may use the end
+	after it is closed.
+	@returns 0
+*/
+int pipe_reader_close(void* pipecb);
+
+/**
+	@brief Close the write end of a pipe.
+
+	@see pipe_reader_close
+	@returns 0
+*/
+int pipe_writer_close(void* pipecb);
+
+/**
+	@brief Move data from one pipe to another.
+
+	Block until there is data in @c src (or its write end is closed), and
+	until there is space in @c dst (or its read end is closed). Then move
+	up to @c n bytes directly from the ring buffer of @c src to the ring
+	buffer of @c dst. The two pipes are never locked while blocking, and
+	they are locked together in address order.
+
+	@returns the number of bytes moved, 0 if @c src is empty and its write
+	end is closed, or -1 if the read end of @c src or either end of @c dst
+	is closed.
+*/
+int pipe_splice(pipe_cb* src, pipe_cb* dst, unsigned int n);
+
+/**
+	@brief Return the pipe read by a stream, or NULL.
+
+	This is used by @c Splice to find streams whose data is held in a 
+	pipe buffer, i.e., pipe ends and connected sockets.
+*/
+pipe_cb* pipe_source(FCB* fcb);
+
+/**
+	@brief Return the pipe written by a stream, or NULL.
+	@see pipe_source
+*/
+pipe_cb* pipe_sink(FCB* fcb);
+
+/** @} */
+
+#endif
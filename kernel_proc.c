@@ -21,6 +21,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* Protects the process table and the process tree */
+Mutex proc_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -43,6 +46,7 @@ static inline void initialize_PCB(PCB* pcb)
   // Also initiallizing our list
   rlnode_init(&pcb->ptcb_list, pcb);
 
+  pcb->fidt_lock = MUTEX_INIT;
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
 
@@ -81,7 +85,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -98,7 +102,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -138,7 +142,10 @@ void start_main_thread()
 Pid_t sys_Exec(Task call, int argl, void* args)
 {
   PCB *curproc, *newproc;
+  TCB* main_thread = NULL;
   
+  Mutex_Lock(&proc_lock);
+
   /* The new process PCB */
   newproc = acquire_PCB();
 
@@ -159,11 +166,13 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
+    Mutex_Lock(&curproc->fidt_lock);
     for(int i=0; i<MAX_FILEID; i++) {
        newproc->FIDT[i] = curproc->FIDT[i];
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    Mutex_Unlock(&curproc->fidt_lock);
   }
 
 
@@ -214,12 +223,17 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     new_ptcb->tcb = newproc->main_thread;
     newproc->main_thread->ptcb = new_ptcb;
     newproc->thread_count += 1;
-   
-    wakeup(new_ptcb->tcb);
+    main_thread = new_ptcb->tcb;
   }
 
 
 finish:
+  Mutex_Unlock(&proc_lock);
+
+  /* Once we wake up the new thread, it may run! */
+  if(main_thread != NULL)
+    wakeup(main_thread);
+
   return get_pid(newproc);
 }
 
@@ -233,7 +247,10 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  Mutex_Lock(&proc_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(&proc_lock);
+  return ppid;
 }
 
 
@@ -268,7 +285,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -292,7 +309,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -309,15 +326,19 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Mutex_Lock(&proc_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  Mutex_Unlock(&proc_lock);
+  return cpid;
 }
 
 
@@ -329,7 +350,9 @@ void sys_Exit(int exitval)
 
   PCB *curproc = CURPROC;  /* cache for efficiency */
   /* First, store the exit status */
+  Mutex_Lock(&proc_lock);
   curproc->exitval = exitval;
+  Mutex_Unlock(&proc_lock);
 
   /* 
     Here, we must check that we are not the init task. 
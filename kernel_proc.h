@@ -34,6 +34,9 @@ typedef enum pid_state_e {
   @brief Process Control Block.
 
   This structure holds all information pertaining to a process.
+
+  The fields of the PCB are protected by @c proc_lock, except for
+  @c FIDT, which is protected by the process' own @c fidt_lock.
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
@@ -61,10 +64,19 @@ typedef struct process_control_block {
                              process terminates. It is used in the implementation of
                              @c WaitChild() */
 
+  Mutex fidt_lock;        /**< @brief Protects @c FIDT */
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
 
 } PCB;
 
+/**
+  @brief The process table lock.
+
+  This lock protects the process table, the process tree and the
+  thread bookkeeping (PTCBs) of every process.
+ */
+extern Mutex proc_lock;
+
 /**
   @brief Initialize the process table.
 
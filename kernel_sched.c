@@ -21,8 +21,8 @@
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 
-#define PRIORITY_QUEUES 10
-#define YIELDS 50
+/* Interval between priority boosts (in microseconds), 0 if disabled */
+static TimerDuration boost_interval;
 
 /* 
 	The current core's CCB. This must only be used in a 
@@ -57,27 +57,33 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. Therefore, we
+  allocate the TCB at the top of the memory block used as the stack,
+  and (optionally) a guard page at the bottom.
 
   +-------------+
   |   TCB       |
   +-------------+
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |   (STACK_MMAP mode only)
   +-------------+
 
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  not corrupt the TCB; with a guard page, it causes a segmentation fault.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
+
+  The stack mode and size are set at boot. In STACK_MMAP mode, the whole
+  block is mapped with MAP_NORESERVE, so that the stack pages are only
+  committed when they are touched.
  */
 
 /*
@@ -90,47 +96,167 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
 
+/* Round up to a multiple of SYSTEM_PAGE_SIZE */
+#define PAGE_ROUND(size) \
+	((((size) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
-#define THREAD_TCB_SIZE \
-	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+#define THREAD_TCB_SIZE PAGE_ROUND(sizeof(TCB))
+
+/* The thread block geometry, set at boot */
+static stack_mode thread_mode = STACK_MALLOC;
+static size_t thread_stack = PAGE_ROUND(BOOT_THREAD_STACK_SIZE);
+static size_t thread_guard = 0;
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+#define THREAD_SIZE (thread_guard + thread_stack + THREAD_TCB_SIZE)
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* The TCB of a thread block, and the thread block of a TCB */
+#define BLOCK_TCB(ptr) ((TCB*)((void*)(ptr) + thread_guard + thread_stack))
+#define TCB_BLOCK(tcb) ((void*)(tcb) - thread_stack - thread_guard)
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  A thread may migrate between reading its core id and reading the CCB
+  of that core, and then it would see another thread. The stack pointer
+  tells: it lies in the stack below the TCB of the current thread. If 
+  the check fails, we fall back to cur_thread(), which reads the CCB 
+  with preemption off.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+TCB* cur_thread_fast()
+{
+	char* sp = __builtin_frame_address(0);
+	TCB* tcb = __atomic_load_n(&cctx[cpu_core_id].current_thread, __ATOMIC_RELAXED);
 
-void* allocate_thread(size_t size)
+	/* Idle threads live in the CCBs, and run on the core stacks */
+	if (tcb == NULL || ((void*)tcb >= (void*)cctx && (void*)tcb < (void*)(cctx + MAX_CORES)))
+		return NULL;
+	if (sp < (char*)tcb && sp >= (char*)tcb - thread_stack)
+		return tcb;
+
+	tcb = cur_thread();
+	return (tcb->type == IDLE_THREAD) ? NULL : tcb;
+}
+
+/*
+  Use mmap to allocate a thread. The stack is mapped without reserving 
+  swap space, and the lowest page is a "sentinel page" with access 
+  PROT_NONE, so that a stack overflow is detected as seg.fault.
+ */
+static void* mmap_thread(size_t size)
 {
 	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr, thread_guard, PROT_NONE));
 
 	return ptr;
 }
-#else
+
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but
   cannot be made easily to 'detect' stack overflow.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
-
-void* allocate_thread(size_t size)
+static void* malloc_thread(size_t size)
 {
 	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
 	CHECK((ptr == NULL) ? -1 : 0);
 	return ptr;
 }
-#endif
 
+void free_thread(void* ptr, size_t size) 
+{ 
+	if (thread_mode == STACK_MMAP) {
+		CHECK(munmap(ptr, size));
+	} else
+		free(ptr); 
+}
+
+void* allocate_thread(size_t size)
+{
+	return (thread_mode == STACK_MMAP) ? mmap_thread(size) : malloc_thread(size);
+}
+
+
+/*
+  The thread block caches.
+
+  Each core keeps a list of thread blocks (TCB and stack), released by
+  threads that exited on it, so that spawn_thread() can usually avoid
+  the memory allocator. The list is linked through the TCB area of
+  each free block. A core's cache is only accessed by the core itself,
+  with preemption off, therefore it needs no lock. Blocks released beyond 
+  the high-water mark thread_cache_limit are freed.
+*/
+static uint thread_cache_limit;
+
+typedef struct thread_block {
+	struct thread_block* next;
+} thread_block;
+
+static void thread_cache_push(CCB* ccb, TCB* tcb)
+{
+	thread_block* blk = (thread_block*) tcb;
+	blk->next = ccb->thread_cache;
+	ccb->thread_cache = blk;
+	ccb->thread_cache_count++;
+}
+
+/* Get the TCB of a thread block, from the current core's cache if possible */
+static TCB* get_thread_block()
+{
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	thread_block* blk = ccb->thread_cache;
+	if (blk != NULL) {
+		ccb->thread_cache = blk->next;
+		ccb->thread_cache_count--;
+		ccb->thread_cache_hits++;
+	} else
+		ccb->thread_cache_misses++;
+	if (preempt)
+		preempt_on;
+
+	return (blk != NULL) ? (TCB*)blk : BLOCK_TCB(allocate_thread(THREAD_SIZE));
+}
+
+/* Return the thread block of a TCB to the current core's cache, or free it */
+static void put_thread_block(TCB* tcb)
+{
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	if (ccb->thread_cache_count < thread_cache_limit) {
+		thread_cache_push(ccb, tcb);
+		tcb = NULL;
+	}
+	if (preempt)
+		preempt_on;
+
+	if (tcb != NULL)
+		free_thread(TCB_BLOCK(tcb), THREAD_SIZE);
+}
+
+/* Free all the blocks in a core's cache */
+static void drain_thread_cache(CCB* ccb)
+{
+	while (ccb->thread_cache != NULL) {
+		thread_block* blk = ccb->thread_cache;
+		ccb->thread_cache = blk->next;
+		free_thread(TCB_BLOCK(blk), THREAD_SIZE);
+	}
+	ccb->thread_cache_count = 0;
+}
 
+void thread_cache_stats(thread_cache_info* info)
+{
+	info->hits = info->misses = 0;
+	info->cached = 0;
+	info->limit = thread_cache_limit;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		info->hits += cctx[c].thread_cache_hits;
+		info->misses += cctx[c].thread_cache_misses;
+		info->cached += cctx[c].thread_cache_count;
+	}
+}
 
 
 /*
@@ -155,7 +281,7 @@ static void thread_start()
 TCB* spawn_thread(PCB* pcb, void (*func)())
 {
 	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	TCB* tcb = get_thread_block();
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -166,21 +292,32 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->state_spinlock = MUTEX_INIT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
+	tcb->priority = 0;
+	tcb->pi_priority = -1;
+	rlnode_init(&tcb->pi_lenders, NULL);
+	tcb->mutex_wait = NULL;
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
+	tcb->last_core = tcb->queue_core = cpu_core_id;
+
+	/* Threads inherit the affinity of the thread that creates them */
+	TCB* creator = cur_thread();
+	tcb->affinity = (creator && creator->type == NORMAL_THREAD)
+		? creator->affinity : AFFINITY_ALL;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = TCB_BLOCK(tcb) + thread_guard;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, thread_stack, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + thread_stack);
 #endif
 
 	/* increase the count of active threads */
@@ -192,15 +329,19 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called without any scheduler lock held. The TCB is 
+  not accessible by any other core.
  */
 void release_TCB(TCB* tcb)
 {
+	/* A thread must not exit while it owns a contended mutex */
+	assert(is_rlist_empty(&tcb->pi_lenders) && tcb->pi_priority < 0);
+
 #ifndef NVALGRIND
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	put_thread_block(tcb);
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -218,137 +359,602 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core owns a set of MLFQ run queues (one doubly linked list per
+  priority level), stored in its CCB and protected by the core's
+  @c sched_spinlock. A thread that becomes ready is queued on the 
+  core that made it ready. A core whose queues are empty steals a 
+  ready thread from another core, before it falls back to its idle
+  thread.
+
+  The state of each thread (@c state, @c phase and the timeout) is 
+  protected by the thread's own @c state_spinlock.
+
+  Also, the scheduler keeps all the sleeping threads with a timeout
+  in a hashed timer wheel, protected by @c timeout_spinlock.
+
+  The locks must be taken in the following order:
+    state_spinlock  ->  timeout_spinlock  ->  sched_spinlock
+  The only exception is the expiry of timeouts, where the thread locks
+  are taken with Mutex_TryLock().
+*/
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+/*
+  The timer wheel.
+
+  Time is divided into ticks of TIMER_WHEEL_TICK microseconds. A thread 
+  whose timeout expires at tick t is kept in slot (t mod TIMER_WHEEL_SLOTS),
+  in no particular order, so that adding and removing a timeout is O(1).
+  The ticks before timer_wheel_tick have been expired; each scan visits
+  the slots of the ticks that elapsed since the previous scan, and wakes 
+  up the threads whose tick has passed. Threads that are due in a later
+  round of the wheel stay in their slot.
+*/
+#define TIMER_WHEEL_SLOTS 256	/* must be a power of 2 */
+#define TIMER_WHEEL_TICK 1000L
 
-  Both of these structures are protected by @c sched_spinlock.
+static rlnode TIMER_WHEEL[TIMER_WHEEL_SLOTS]; /* The slots of the timer wheel */
+Mutex timeout_spinlock = MUTEX_INIT; /* spinlock for TIMER_WHEEL */
+
+/* The first tick that has not been expired yet */
+static volatile TimerDuration timer_wheel_tick;
+
+/* The number of threads in TIMER_WHEEL, used to avoid taking the lock */
+static volatile uint timeout_count;
+
+/* 
+  A lower bound of the tick when the next timeout expires, or NO_TIMEOUT
+  if TIMER_WHEEL is empty. It is lowered when a timeout is added, and it
+  is recomputed only when a scan goes past it, so that idle cores can
+  read it without the lock. A timeout that is removed early may leave it
+  too low, which costs at most one early wakeup of an idle core.
+*/
+static volatile TimerDuration timer_wheel_due = NO_TIMEOUT;
+
+static inline rlnode* timer_wheel_slot(TimerDuration tick)
+{
+	return &TIMER_WHEEL[tick & (TIMER_WHEEL_SLOTS-1)];
+}
+
+/*
+  Idle cores.
+
+  A core sets its bit in idle_cores before its idle thread checks for
+  ready threads and halts, and clears it when it leaves its idle thread.
+  A core that queues a thread claims (clears) the bit of some idle core
+  and restarts it. Both sides use sequentially consistent atomics, so
+  either the idle core sees the new thread, or the queueing core sees the
+  idle bit; a restart that arrives before the halt is not lost.
 */
+static volatile uint32_t idle_cores;
 
-int numof_yield_calls = 0; // num of yield_calls
+/* The idle cores that are worth restarting, i.e., those that run on a host core */
+static uint32_t restart_cores;
 
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+/* The bitmap of all cores */
+static uint32_t all_cores;
+
+/* Return non-zero if the thread may run on core c */
+static inline int sched_allowed(TCB* tcb, uint c)
+{
+	return (tcb->affinity >> c) & 1;
+}
+
+/*
+  The priority a thread is scheduled with: its own, or the one lent to
+  it by a thread blocked on a mutex that it owns, if that is higher.
+*/
+static inline int sched_priority(TCB* tcb)
+{
+	return (tcb->pi_priority > tcb->priority) ? tcb->pi_priority : tcb->priority;
+}
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
-/* Interrupt handle for inter-core interrupts */
+/* 
+  Interrupt handler for inter-core interrupts. Another core queued a 
+  thread here, with a higher priority than the current thread.
+*/
 void ici_handler()
-{ /* noop for now... */
+{
+	CCB* ccb = &CURCORE;
+	uint levels = ccb->ready_levels;
+	if (CURTHREAD == &ccb->idle_thread ||
+		(levels != 0 && 31 - __builtin_clz(levels) > sched_priority(CURTHREAD)))
+		yield(SCHED_PREEMPT);
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the scheduler timer wheel.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		tcb->wakeup_time = curtime + timeout;
+		TimerDuration tick = tcb->wakeup_time / TIMER_WHEEL_TICK;
+
+		Mutex_Lock(&timeout_spinlock);
+
+		/* An empty wheel has nothing to catch up with */
+		if (timeout_count == 0)
+			timer_wheel_tick = curtime / TIMER_WHEEL_TICK;
+
+		/* A tick that was already expired is handled by the next scan */
+		if (tick < timer_wheel_tick)
+			tick = timer_wheel_tick;
+
+		rlist_push_back(timer_wheel_slot(tick), &tcb->sched_node);
+		timeout_count++;
+		if (tick < timer_wheel_due)
+			timer_wheel_due = tick;
+
+		Mutex_Unlock(&timeout_spinlock);
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Clamp a priority into the range of valid run queue levels.
+*/
+static inline int sched_level(int priority)
+{
+	if (priority < 0) return 0;
+	if (priority >= PRIORITY_QUEUES) return PRIORITY_QUEUES-1;
+	return priority;
+}
+
+/*
+  Set the priority of a thread popped from a run queue level. The
+  level may have been boosted by aging, or by a priority loan, which
+  does not change the thread's own priority.
+*/
+static inline void sched_set_popped_level(TCB* tcb, int level)
+{
+	if (level > tcb->pi_priority)
+		tcb->priority = level;
+}
+
+/*
+  Remove and return the first thread of the highest non-empty
+  priority level of a core's run queues, or NULL if they are empty.
+  The level is found in constant time from the ready_levels bitmap.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static TCB* sched_queue_pop(CCB* ccb)
 {
+	if (ccb->ready_levels == 0)
+		return NULL;
+
+	int level = 31 - __builtin_clz(ccb->ready_levels);
+	rlnode* queue = &ccb->sched_queue[level];
+
+	TCB* tcb = rlist_pop_front(queue)->tcb;
+	sched_set_popped_level(tcb, level);
+	if (is_rlist_empty(queue))
+		ccb->ready_levels &= ~(1u << level);
+	ccb->ready_count--;
+	if (tcb->shared)
+		ccb->steal_count--;
+	return tcb;
+}
+
+/*
+  Remove and return the first thread of the highest level of a core's
+  run queues which may run on core c, or NULL if there is none.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_pop_for(CCB* ccb, uint c)
+{
+	for (uint levels = ccb->ready_levels; levels != 0; ) {
+		int level = 31 - __builtin_clz(levels);
+		levels &= ~(1u << level);
+		rlnode* queue = &ccb->sched_queue[level];
+
+		for (rlnode* n = queue->next; n != queue; n = n->next) {
+			TCB* tcb = n->tcb;
+			if (!sched_allowed(tcb, c))
+				continue;
+			rlist_remove(n);
+			sched_set_popped_level(tcb, level);
+			if (is_rlist_empty(queue))
+				ccb->ready_levels &= ~(1u << level);
+			ccb->ready_count--;
+			if (tcb->shared)
+				ccb->steal_count--;
+			return tcb;
+		}
+	}
+	return NULL;
+}
+
+/*
+  Claim an idle core, so that no other core restarts it for other work.
+  Returns non-zero if the core was idle.
+*/
+static inline int sched_claim_idle_core(uint c)
+{
+	uint32_t cmask = 1u << c;
+	if (! (idle_cores & cmask))
+		return 0;
+	return (__atomic_fetch_and(&idle_cores, ~cmask, __ATOMIC_SEQ_CST) & cmask) != 0;
+}
+
+/*
+  Restart an idle core (other than the current one), if any, so that
+  it steals the threads queued on the current core.
+*/
+static void sched_restart_idle_core()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint32_t idle = idle_cores & restart_cores & ~(1u << cpu_core_id);
+	while (idle) {
+		uint c = __builtin_ctz(idle);
+		if (sched_claim_idle_core(c)) {
+			cpu_core_restart(c);
+			return;
+		}
+		idle &= ~(1u << c);
+	}
+}
+
+/*
+  Add TCB to the end of a core's scheduler list.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_push(CCB* ccb, TCB* tcb)
+{
+	tcb->priority = sched_level(tcb->priority);
+	int level = sched_priority(tcb);
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	Mutex_Lock(&ccb->sched_spinlock);
+	tcb->queue_core = ccb->id;
+	rlist_push_back(&ccb->sched_queue[level], &tcb->sched_node);
+	ccb->ready_levels |= 1u << level;
+	ccb->ready_count++;
+	tcb->shared = (tcb->affinity & all_cores) == all_cores;
+	if (tcb->shared)
+		ccb->steal_count++;
+	Mutex_Unlock(&ccb->sched_spinlock);
+}
+
+/*
+  Add TCB to the queue of a core in its affinity, preferring the core 
+  that last ran it, and restart that core if it is idle.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_remote(TCB* tcb)
+{
+	uint c = tcb->last_core;
+	if (!sched_allowed(tcb, c))
+		c = __builtin_ctz(tcb->affinity & all_cores);
+
+	sched_queue_push(&cctx[c], tcb);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (sched_claim_idle_core(c))
+		cpu_core_restart(c);
+}
+
+/*
+  Add TCB to the end of the current core's scheduler list, and
+  restart an idle core to share the load. A thread that may not 
+  run on the current core goes to another core.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_add(TCB* tcb)
+{
+	if (!sched_allowed(tcb, cpu_core_id)) {
+		sched_queue_remote(tcb);
+		return;
+	}
+
+	sched_queue_push(&CURCORE, tcb);
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	/* Restart a possibly halted core */
+	sched_restart_idle_core();
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+  Return the core of the thread's affinity which runs the lowest-priority
+  thread, if that priority is lower than the thread's, else -1. 
+  Idle cores are not considered. This is a hint, it is not accurate.
+*/
+static int sched_preempt_target(TCB* tcb)
+{
+	int target = -1;
+	int lowest = sched_priority(tcb);
+	for (uint c = 0; c < cpu_cores(); c++) {
+		int prio = cctx[c].current_priority;
+		if (prio >= 0 && prio < lowest && sched_allowed(tcb, c)) {
+			lowest = prio;
+			target = c;
+		}
+	}
+	return target;
+}
+
+/*
+  Queue a thread that just woke up, where it will run soon.
+
+  If the current core is idle, it runs the thread as soon as it
+  returns to its scheduler, and no other core is disturbed (unless more
+  threads are waiting on this core). Else, if
+  the core that last ran the thread is idle, the thread goes there,
+  where its cache is probably still warm. Else, if no core is idle, 
+  the thread is queued on the core running the lowest-priority thread
+  (if lower than its own), which is preempted by an inter-core interrupt.
+  Else, the thread is queued on the current core, and some idle core is
+  restarted to steal it. A core that is claimed before it halts is not
+  signalled at all.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_wakeup(TCB* tcb)
+{
+	CCB* ccb = &CURCORE;
+
+	if (ccb->current_thread == &ccb->idle_thread && sched_allowed(tcb, ccb->id)) {
+		sched_queue_push(ccb, tcb);
+		if (ccb->ready_count > 1)
+			sched_restart_idle_core();
+		return;
+	}
+
+	uint c = tcb->last_core;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (c != ccb->id && sched_allowed(tcb, c) && ((restart_cores >> c) & 1)) {
+		if (sched_claim_idle_core(c)) {
+			sched_queue_push(&cctx[c], tcb);
+			cpu_core_restart(c);
+			return;
+		}
+	}
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	/* With no idle core to take the thread, preempt a lower-priority one */
+	if ((idle_cores & restart_cores & ~(1u << ccb->id)) == 0) {
+		int target = sched_preempt_target(tcb);
+		if (target >= 0 && target != ccb->id) {
+			sched_queue_push(&cctx[target], tcb);
+			cpu_ici(target);
+			return;
+		}
+	}
+
+	sched_queue_add(tcb);
+}
+
+/*
+	Adjust the state of a thread to make it READY, and return 1 if the
+	caller must queue it. A thread whose context is still dirty is queued
+	by gain(), on the core it is leaving.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
-static void sched_make_ready(TCB* tcb)
+static int sched_mark_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from TIMER_WHEEL */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in TIMER_WHEEL, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		Mutex_Lock(&timeout_spinlock);
 		rlist_remove(&tcb->sched_node);
+		if (--timeout_count == 0)
+			timer_wheel_due = NO_TIMEOUT;
+		Mutex_Unlock(&timeout_spinlock);
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
 	/* Mark as ready */
 	tcb->state = READY;
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+	return tcb->phase == CTX_CLEAN;
+}
+
+/*
+	Make a thread READY, and queue it where it will run soon.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_make_ready(TCB* tcb)
+{
+	if (sched_mark_ready(tcb))
+		sched_queue_wakeup(tcb);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Return the tick after which a scan of \c TIMER_WHEEL will expire some
+  timeout, or NO_TIMEOUT if there are no timeouts.
+
+  The slots are visited in tick order. A thread in the slot of tick t is
+  expired by the scan after tick max(t, its own tick), so the search stops 
+  at the first slot that cannot improve on the earliest tick found.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static TimerDuration timer_wheel_earliest()
+{
+	TimerDuration due = NO_TIMEOUT;
+	TimerDuration tick = timer_wheel_tick;
+	for (uint k = 0; k < TIMER_WHEEL_SLOTS && tick < due; k++, tick++) {
+		rlnode* slot = timer_wheel_slot(tick);
+		for (rlnode* n = slot->next; n != slot; n = n->next) {
+			TimerDuration t = n->tcb->wakeup_time / TIMER_WHEEL_TICK;
+			if (t < tick) t = tick;
+			if (t < due) due = t;
+		}
+	}
+	return due;
+}
+
+/*
+  Scan the slots of \c TIMER_WHEEL for the ticks that elapsed since
+  the last scan, and wake up the threads whose timeout has expired.
+
+  Here, timeout_spinlock is held while locking the threads, in the
+  opposite of the usual order, therefore threads whose lock is busy
+  are skipped. A thread lock is busy only while the thread is being
+  woken up, or while it is going to sleep. The scan stops at the 
+  first slot with a skipped thread, so that a later scan revisits it.
 */
 static void sched_wakeup_expired_timeouts()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
 	TimerDuration curtime = bios_clock();
+	TimerDuration curtick = curtime / TIMER_WHEEL_TICK;
+
+	/* Avoid the lock in the common case */
+	if (timeout_count == 0 || curtick <= timer_wheel_tick)
+		return;
+
+	rlnode expired;
+	rlnode_new(&expired);
+
+	Mutex_Lock(&timeout_spinlock);
+
+	/* Visit each slot at most once, even if the wheel went around */
+	TimerDuration tick = timer_wheel_tick;
+	TimerDuration end = curtick;
+	if (end - tick > TIMER_WHEEL_SLOTS)
+		end = tick + TIMER_WHEEL_SLOTS;
+
+	int skipped = 0;
+	for (; tick < end && timeout_count > 0 && !skipped; tick++) {
+		rlnode* slot = timer_wheel_slot(tick);
+		rlnode* n = slot->next;
+		while (n != slot) {
+			TCB* tcb = n->tcb;
+			n = n->next;
+			if (tcb->wakeup_time / TIMER_WHEEL_TICK >= curtick)
+				continue;	/* due in a later round */
+			if (Mutex_TryLock(&tcb->state_spinlock)) {
+				rlist_push_back(&expired, rlist_remove(&tcb->sched_node));
+				timeout_count--;
+				tcb->wakeup_time = NO_TIMEOUT;
+			} else
+				skipped = 1;
+		}
+	}
+	/* Restart from a slot with a skipped thread, else everything before curtick expired */
+	timer_wheel_tick = skipped ? tick-1 : curtick;
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
+	if (timeout_count == 0)
+		timer_wheel_due = NO_TIMEOUT;
+	else if (timer_wheel_due < timer_wheel_tick)
+		timer_wheel_due = timer_wheel_earliest();
+
+	Mutex_Unlock(&timeout_spinlock);
+
+	while (!is_rlist_empty(&expired)) {
+		TCB* tcb = rlist_pop_front(&expired)->tcb;
 		sched_make_ready(tcb);
+		Mutex_Unlock(&tcb->state_spinlock);
 	}
 }
+
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Return the time when the next scan of \c TIMER_WHEEL will expire some
+  timeout (or a little earlier), or NO_TIMEOUT if there are no timeouts.
+  This does not take timeout_spinlock, as it is called at each halt.
+*/
+static TimerDuration sched_next_deadline()
+{
+	TimerDuration due = timer_wheel_due;
+	return (due == NO_TIMEOUT) ? NO_TIMEOUT : (due+1) * TIMER_WHEEL_TICK;
+}
+
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Try to steal a ready thread from the run queues of another core.
+  Cores whose queue lock is busy are skipped, as their owner is
+  probably scheduling. Only cores with threads that may run anywhere
+  are visited, but any thread allowed on the thief may be taken.
 */
+static TCB* sched_queue_steal(CCB* thief)
+{
+	uint ncores = cpu_cores();
 
+	for (uint k = 1; k < ncores; k++) {
+		CCB* victim = &cctx[(thief->id + k) % ncores];
 
-// Weird to implement. Starting from top queue and goind down, trying to fing a thread, to use as a first. 
-// Integer helper is used to break the loop once the thread is found. 
-// If not found, decrease priority and start again.....
+		if (victim->steal_count == 0)
+			continue;
+		if (!Mutex_TryLock(&victim->sched_spinlock))
+			continue;
+		TCB* tcb = sched_queue_pop_for(victim, thief->id);
+		Mutex_Unlock(&victim->sched_spinlock);
+
+		if (tcb != NULL)
+			return tcb;
+	}
+	return NULL;
+}
+
+/*
+  Return non-zero if a core has ready threads in its own queues, or 
+  if it can steal a thread from another core.
+  This is a hint, it is not accurate.
+*/
+static int sched_has_ready_threads(CCB* ccb)
+{
+	if (ccb->ready_count > 0)
+		return 1;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (cctx[c].steal_count > 0)
+			return 1;
+	return 0;
+}
+
+/*
+  Remove the head of the scheduler list, if any, and
+  return it. If the current core's queues are empty and the
+  current thread cannot continue (or is the idle thread), try to steal a thread from
+  another core. 
+*/
 static TCB* sched_queue_select(TCB* current)
 {
-	
-	TCB* next_thread = NULL;
-	int i = PRIORITY_QUEUES;
-	int helper = 0;
-	while(i>0 && helper == 0){
-		rlnode* sel = rlist_pop_front(&SCHED[i]);
-		if(sel->tcb != NULL){
-			next_thread = sel->tcb; /* When the list is empty, this is NULL */
-			helper = 1;	// to escape loop 
-		}
-		else i--;
+	CCB* ccb = &CURCORE;
+
+	TCB* next_thread;
+	while (1) {
+		Mutex_Lock(&ccb->sched_spinlock);
+		next_thread = sched_queue_pop(ccb);
+		Mutex_Unlock(&ccb->sched_spinlock);
+
+		if (next_thread == NULL || sched_allowed(next_thread, ccb->id))
+			break;
+
+		/* Its affinity changed while it was queued, move it */
+		Mutex_Lock(&next_thread->state_spinlock);
+		sched_queue_remote(next_thread);
+		Mutex_Unlock(&next_thread->state_spinlock);
 	}
 
+	/* The current thread may keep running, if it is ready and allowed here */
+	int can_continue = current->state == READY && sched_allowed(current, ccb->id);
+
+	/* An idle core, or one whose thread is leaving it, tries to steal work */
+	if (next_thread == NULL && 
+		(!can_continue || current == &ccb->idle_thread))
+		next_thread = sched_queue_steal(ccb);
+
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = can_continue ? current : &ccb->idle_thread;
+
+	/* A core that found work is not idle any more */
+	uint32_t cmask = 1u << ccb->id;
+	if (next_thread != &ccb->idle_thread && (idle_cores & cmask))
+		__atomic_fetch_and(&idle_cores, ~cmask, __ATOMIC_SEQ_CST);
 
 	next_thread->its = QUANTUM;
 
@@ -365,15 +971,15 @@ int wakeup(TCB* tcb)
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	/* To touch tcb->state, we must get the thread's spinlock. */
+	Mutex_Lock(&tcb->state_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -382,6 +988,108 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup_word(TCB* tcb, volatile int* word, int old, int new)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	int ret = __atomic_compare_exchange_n(word, &old, new, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+	/* Hand the thread off to this core */
+	if (ret && tcb->state == STOPPED && sched_mark_ready(tcb))
+		sched_queue_add(tcb);
+
+	Mutex_Unlock(&tcb->state_spinlock);
+	if (preempt)
+		preempt_on;
+
+	return ret;
+}
+
+/*
+  Move a ready thread to the run queue of its (changed) priority.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_move(TCB* tcb)
+{
+	CCB* ccb = &cctx[tcb->queue_core];
+	int level = sched_priority(tcb);
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	/* The thread may have been popped, but not started yet */
+	if (tcb->sched_node.next != &tcb->sched_node) {
+		rlist_remove(&tcb->sched_node);
+		rlist_push_back(&ccb->sched_queue[level], &tcb->sched_node);
+
+		/* The old level is not known, because of aging */
+		uint levels = 0;
+		for (int i = 0; i < PRIORITY_QUEUES; i++)
+			if (!is_rlist_empty(&ccb->sched_queue[i]))
+				levels |= 1u << i;
+		ccb->ready_levels = levels;
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
+
+	/* Preempt the core, if it runs a thread of lower priority */
+	int prio = ccb->current_priority;
+	if (ccb->id != cpu_core_id && prio >= 0 && prio < level)
+		cpu_ici(ccb->id);
+}
+
+int sched_thread_priority(TCB* tcb)
+{
+	return sched_priority(tcb);
+}
+
+void sched_lend_priority(TCB* tcb, int prio)
+{
+	int preempt = preempt_off;
+
+	Mutex_Lock(&tcb->state_spinlock);
+	int old = sched_priority(tcb);
+	tcb->pi_priority = prio;
+	int level = sched_priority(tcb);
+
+	if (level != old && tcb->state == READY && tcb->phase == CTX_CLEAN)
+		sched_queue_move(tcb);
+	else if (level != old && tcb->state == RUNNING) {
+		CCB* ccb = &cctx[tcb->last_core];
+		if (ccb->current_thread == tcb)
+			ccb->current_priority = level;
+	}
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	if (preempt)
+		preempt_on;
+}
+
+void sched_check_preempt()
+{
+	int preempt = preempt_off;
+
+	/* Give the core to a higher-priority thread (e.g., one we woke up) */
+	uint levels = CURCORE.ready_levels;
+	if (preempt && levels != 0 && 31 - __builtin_clz(levels) > sched_priority(CURTHREAD))
+		yield(SCHED_PREEMPT);
+
+	if (preempt)
+		preempt_on;
+}
+
+void set_core_affinity(TCB* tcb, uint mask)
+{
+	assert((mask & all_cores) != 0);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->state_spinlock);
+	tcb->affinity = mask;
+	Mutex_Unlock(&tcb->state_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -393,7 +1101,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -402,13 +1110,15 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
-	/* Release mx */
+	/* Release the thread spinlock before calling yield() !!! */
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	/* Release mx. This may wake up threads parked on it, which must not
+	   happen while we hold our spinlock. A wakeup of this thread after
+	   this point is not lost, because the state is already set. */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -417,28 +1127,84 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		preempt_on;
 }
 
-// Function boost threads, boosts threads that are down in priority, starting at priority = 0, after 10 yields. This happens by finding 
-// threads and adding 1 to their priority.
-void boost_threads(){
-	for(int i=0; i<PRIORITY_QUEUES; i++){
-		for(int j = 0; j<rlist_len(&SCHED[i]); j++){
-			rlnode* thr = rlist_pop_front(&SCHED[i]);
-			if(thr->tcb != NULL){
-				thr->tcb->priority += 1;
-				rlist_push_back(&SCHED[i+1], thr);
-			}
-		}
+/*
+  Put the current process to sleep, unless *word has changed.
+ */
+void sleep_on_word(volatile int* word, int val, Mutex* mx,
+	enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	int preempt = preempt_off;
+	TCB* tcb = CURTHREAD;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	/* The word is changed by wakeup_word() under our spinlock */
+	if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) {
+		Mutex_Unlock(&tcb->state_spinlock);
+		if (mx != NULL)
+			Mutex_Unlock(mx);
+		if (preempt)
+			preempt_on;
+		return;
 	}
+
+	tcb->state = STOPPED;
+	sched_register_timeout(tcb, timeout);
+
+	/* As in sleep_releasing(), mx is released after our spinlock */
+	Mutex_Unlock(&tcb->state_spinlock);
+	if (mx != NULL)
+		Mutex_Unlock(mx);
+
+	yield(cause);
+
+	if (preempt)
+		preempt_on;
 }
 
-/* This function is the entry point to the scheduler's context switching */
+/*
+  Priority boosting (aging).
 
+  Every boost_interval, all threads in the run queues of a core move
+  up by one level, and the top level absorbs the level below it. 
+  This is done by splicing whole levels, so the lock is held for
+  O(PRIORITY_QUEUES) time, regardless of the number of ready threads.
+  The priority of a thread is set from its level when it is popped.
 
-void yield(enum SCHED_CAUSE cause)
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static void boost_threads(CCB* ccb)
 {
+	for(int i=PRIORITY_QUEUES-1; i>0; i--)
+		rlist_append(&ccb->sched_queue[i], &ccb->sched_queue[i-1]);
+
+	uint top = 1u << (PRIORITY_QUEUES-1);
+	ccb->ready_levels = ((ccb->ready_levels << 1) | (ccb->ready_levels & top)) 
+		& ((top << 1) - 1);
+}
+
+/*
+  Boost the current core's run queues, if it is time to do so.
+*/
+static void sched_maybe_boost(CCB* ccb)
+{
+	if (boost_interval == 0)
+		return;
+
+	TimerDuration curtime = bios_clock();
+	if (curtime < ccb->next_boost)
+		return;
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	boost_threads(ccb);
+	Mutex_Unlock(&ccb->sched_spinlock);
+	ccb->next_boost = curtime + boost_interval;
+}
+
+/* This function is the entry point to the scheduler's context switching */
 
-	numof_yield_calls = numof_yield_calls + 1;
 
+void yield(enum SCHED_CAUSE cause)
+{
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
 
@@ -449,7 +1215,7 @@ void yield(enum SCHED_CAUSE cause)
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&current->state_spinlock);
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -460,14 +1226,13 @@ void yield(enum SCHED_CAUSE cause)
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
+	Mutex_Unlock(&current->state_spinlock);
+
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
-	// Time to do some boosting...
-	if(numof_yield_calls > YIELDS){
-		boost_threads();
-		numof_yield_calls =0;
-	}
+	/* Age the threads in the run queues */
+	sched_maybe_boost(&CURCORE);
 
 
 	/* Get next */
@@ -477,8 +1242,6 @@ void yield(enum SCHED_CAUSE cause)
 	/* Save the current TCB for the gain phase */
 	CURCORE.previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
-
 	/* Switch contexts */
 	if (current != next) {
 		CURTHREAD = next;
@@ -489,28 +1252,24 @@ void yield(enum SCHED_CAUSE cause)
 	
 	// When the cause is SCHED_QUANTUM, it means that the thread hasn't completed its task in the given quantum and must give up place and reduce priority by 1
 	case (SCHED_QUANTUM):
-		if(current->priority > 0)
-			current->priority = current->priority - 1;
-		else current->priority = 0;
+		current->priority = sched_level(current->priority - 1);
 	break;
 
 	// When the cause is SCHED_IO, it means that we have a thread waiting for I/O, which means that it will take a little time, and so give it a higher priority
 	case (SCHED_IO): 
-		if(current->priority < PRIORITY_QUEUES)
-			current->priority = current->priority + 1;
-		//else current->priority = PRIORITY_QUEUES;
+		current->priority = sched_level(current->priority + 1);
 	break;
 
-	// When i have SCHED_MUTEX, it means that my high priority thread wants a mutex that is currently used by a low priority thread, meaning that i have to decrease
-	// the high-priority thread so that i give the low-priority thread a chance to finish and release the wanted mutex
-	case(SCHED_MUTEX):
-		if((current->priority = current->last_cause) == SCHED_MUTEX) //&& current->priority>0)
-			current->priority = current->priority - 1;
+	// When the cause is SCHED_MUTEX, the thread blocked on a mutex owned by a lower-priority thread, which inherited its priority
+	// meanwhile, so the thread keeps its priority. When the cause is SCHED_PREEMPT, the thread lost the core to a higher-priority 
+	// thread, through no fault of its own
+	case (SCHED_MUTEX):
+	case (SCHED_PREEMPT):
 	break;
 
+	// Any other cause (the thread slept, or gave up the core) sends it to the top level
 	default:
-	for(current->priority = 0; current->priority<PRIORITY_QUEUES; current->priority++)
-		current->priority = current->priority;
+		current->priority = PRIORITY_QUEUES-1;
 	break;
 	}
 
@@ -536,18 +1295,25 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
+	Mutex_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->last_core = cpu_core_id;
+	Mutex_Unlock(&current->state_spinlock);
+
+	/* Publish the priority, for cores looking for a thread to preempt */
+	CURCORE.current_priority = (current->type == IDLE_THREAD) ? -1 : sched_priority(current);
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
+		int exited = 0;
+
+		Mutex_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
@@ -555,23 +1321,26 @@ void gain(int preempt)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
+			exited = 1;
 			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
-	}
+		Mutex_Unlock(&prev->state_spinlock);
 
-	Mutex_Unlock(&sched_spinlock);
+		if (exited)
+			release_TCB(prev);
+	}
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set a 1-quantum alarm, unless the core is idle */
+	if (current->type != IDLE_THREAD)
+		bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -579,9 +1348,20 @@ static void idle_thread()
 	/* When we first start the idle thread */
 	yield(SCHED_IDLE);
 
-	/* We come here whenever we cannot find a ready thread for our core */
+	/* We come here whenever we cannot find a ready thread for our core.
+	   Halt only if there is nothing left to steal from other cores. The
+	   idle thread has no quantum, so the core sleeps until a thread is
+	   queued, an interrupt arrives, or the next timeout is due. */
+	uint32_t cmask = 1u << cpu_core_id;
 	while (active_threads > 0) {
-		cpu_core_halt();
+		int preempt = preempt_off;
+		__atomic_fetch_or(&idle_cores, cmask, __ATOMIC_SEQ_CST);
+		if (!sched_has_ready_threads(&CURCORE)) {
+			TimerDuration deadline = sched_next_deadline();
+			cpu_core_halt_until(deadline == NO_TIMEOUT ? CPU_NO_DEADLINE : deadline);
+		}
+		__atomic_fetch_and(&idle_cores, ~cmask, __ATOMIC_SEQ_CST);
+		if (preempt) preempt_on;
 		yield(SCHED_IDLE);
 	}
 
@@ -593,13 +1373,48 @@ static void idle_thread()
 /*
   Initialize the scheduler queue
  */
-void initialize_scheduler()
+void initialize_scheduler(const boot_options* opts)
 {
-	for(int i=0; i<PRIORITY_QUEUES; i++){
-		rlnode_init(&SCHED[i], NULL);
+	boost_interval = 1000 * (TimerDuration) opts->boost_interval;
+
+	/* The thread block geometry */
+	thread_mode = opts->thread_stack_mode;
+	thread_stack = PAGE_ROUND(opts->thread_stack_size > 0 ? 
+		opts->thread_stack_size : BOOT_THREAD_STACK_SIZE);
+	thread_guard = (thread_mode == STACK_MMAP) ? SYSTEM_PAGE_SIZE : 0;
+
+	for(int c=0; c<MAX_CORES; c++) {
+		CCB* ccb = &cctx[c];
+		ccb->sched_spinlock = MUTEX_INIT;
+		for(int i=0; i<PRIORITY_QUEUES; i++)
+			rlnode_init(&ccb->sched_queue[i], NULL);
+		ccb->ready_levels = 0;
+		ccb->ready_count = 0;
+		ccb->steal_count = 0;
+		ccb->current_priority = -1;	/* Not a preemption target, until it runs */
+		ccb->next_boost = boost_interval;
+
+		ccb->thread_cache = NULL;
+		ccb->thread_cache_count = 0;
+		ccb->thread_cache_hits = 0;
+		ccb->thread_cache_misses = 0;
 	}
 
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	/* Warm up the thread caches of the cores */
+	thread_cache_limit = opts->thread_cache_size;
+	for(uint c=0; c<cpu_cores(); c++)
+		while(cctx[c].thread_cache_count < thread_cache_limit)
+			thread_cache_push(&cctx[c], BLOCK_TCB(allocate_thread(THREAD_SIZE)));
+
+	for(int i=0; i<TIMER_WHEEL_SLOTS; i++)
+		rlnode_init(&TIMER_WHEEL[i], NULL);
+	timer_wheel_tick = 0;
+	timer_wheel_due = NO_TIMEOUT;
+	timeout_count = 0;
+	idle_cores = 0;
+	restart_cores = (cpu_physical_cores() >= 32) ? ~0u 
+		: (1u << cpu_physical_cores()) - 1;
+	all_cores = (cpu_cores() >= 32) ? ~0u : (1u << cpu_cores()) - 1;
 }
 
 void run_scheduler()
@@ -616,6 +1431,7 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.state_spinlock = MUTEX_INIT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -623,6 +1439,12 @@ void run_scheduler()
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
+	curcore->idle_thread.last_core = curcore->id;
+	curcore->idle_thread.pi_priority = -1;
+	rlnode_init(&curcore->idle_thread.pi_lenders, NULL);
+	curcore->idle_thread.mutex_wait = NULL;
+	curcore->current_priority = -1;
+	curcore->idle_thread.affinity = 1u << curcore->id;
 
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
@@ -636,4 +1458,7 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* Release the thread cache of this core */
+	drain_thread_cache(curcore);
 }
@@ -84,11 +84,12 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock blocked on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A higher-priority thread was queued by another core */
 };
 
 /**
@@ -103,6 +104,11 @@ typedef struct thread_control_block {
   PTCB* ptcb;
 
   int priority; // Priority for MLFQ
+	int pi_priority; /**< @brief Priority lent by threads blocked on a mutex it owns, or -1 */
+	rlnode pi_lenders; /**< @brief The threads blocked on mutexes it owns (see kernel_cc.c) */
+	struct __wq_waiter* mutex_wait; /**< @brief Where it is blocked on a mutex, or NULL */
+
+	Mutex state_spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time */
 
 	cpu_context_t context; /**< @brief The thread context */
 	Thread_type type; /**< @brief The type of thread */
@@ -120,6 +126,11 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	uint last_core; /**< @brief The core that last ran this thread (or created it) */
+	uint affinity; /**< @brief Bitmap of the cores this thread may run on */
+	int shared; /**< @brief The thread was queued as runnable on every core */
+	uint queue_core; /**< @brief The core whose run queues the thread was last added to */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -152,21 +163,35 @@ typedef struct process_thread_control_block {
 } PTCB;
 
 
-/** @brief Thread stack size.
-
-  The default thread stack size in TinyOS is 128 kbytes.
- */
-#define THREAD_STACK_SIZE (128 * 1024)
-
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Number of MLFQ priority levels.
+
+  Level @c PRIORITY_QUEUES-1 is the highest priority.
+ */
+#define PRIORITY_QUEUES 10
+
+#if PRIORITY_QUEUES > 32
+#error "PRIORITY_QUEUES must fit in the ready_levels bitmap of the CCB"
+#endif
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core also keeps a cache of thread blocks, recycled from exited
+  threads. It is only accessed by its own core, with preemption off.
+
+  Each core owns a set of MLFQ run queues, protected by its own
+  @c sched_spinlock. A thread that wakes up is queued on the core that
+  last ran it, if that core is idle, else on the core that made it ready.
+  Idle cores steal ready threads from the queues of other cores.
+  A thread is only queued on a core of its affinity, and only
+  stolen by such a core.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -175,6 +200,19 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_spinlock; /**< @brief Protects the run queues of this core */
+	rlnode sched_queue[PRIORITY_QUEUES]; /**< @brief The MLFQ run queues of this core */
+	uint ready_levels; /**< @brief Bitmap of the non-empty levels of @c sched_queue */
+	volatile uint ready_count; /**< @brief Number of threads in @c sched_queue */
+	volatile uint steal_count; /**< @brief Number of threads in @c sched_queue that any core may run */
+	volatile int current_priority; /**< @brief Priority of the current thread, -1 when idle */
+	TimerDuration next_boost; /**< @brief Time of the next priority boost of this core */
+
+	void* thread_cache; /**< @brief List of recycled thread blocks of this core */
+	uint thread_cache_count; /**< @brief Number of blocks in @c thread_cache */
+	unsigned long thread_cache_hits; /**< @brief Threads spawned from @c thread_cache */
+	unsigned long thread_cache_misses; /**< @brief Threads spawned from fresh memory */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -224,6 +262,18 @@ TCB* cur_thread();
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+  @brief Get the statistics of the thread block caches.
+
+  The counters are summed over all cores. A hit is a thread spawned 
+  with a recycled thread block, a miss is a thread that needed fresh memory.
+  The counters of other cores are read without locking, so they may be 
+  slightly stale.
+
+  @param info the statistics are stored here
+*/
+void thread_cache_stats(thread_cache_info* info);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -268,6 +318,103 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief The current thread, as seen without turning preemption off.
+
+  This is like @c cur_thread(), but cheaper. It returns NULL for the 
+  idle threads and at boot.
+ */
+TCB* cur_thread_fast();
+
+/**
+  @brief The priority a thread is scheduled with.
+
+  This is the higher of the thread's own priority and the priority 
+  lent to it (see @c sched_lend_priority()).
+ */
+int sched_thread_priority(TCB* tcb);
+
+/**
+  @brief Set the priority lent to a thread.
+
+  This is called for the owner of a mutex that other threads are blocked
+  on, with the highest priority among them (priority inheritance), or 
+  with -1 when no thread lends it a priority any more. While the loan 
+  lasts, the thread is scheduled with the higher of its own priority
+  and the lent one, so that it releases the mutex soon. A ready thread
+  is moved to the run queue of its new priority at once.
+
+  The caller must make sure that @c tcb does not exit during the call.
+
+  @param tcb the thread that owns the mutex
+  @param prio the lent priority, or -1
+ */
+void sched_lend_priority(TCB* tcb, int prio);
+
+/**
+  @brief Yield, if a thread of higher priority is ready on this core.
+
+  This is called by a mutex owner whose loan was lowered, after it 
+  wakes up a thread that was blocked on the mutex.
+ */
+void sched_check_preempt();
+
+/**
+  @brief Block the current thread, while a word holds a value.
+
+  This is like @c sleep_releasing() with state @c STOPPED, except that the
+  thread does not block at all if @c *word is not equal to @c val. The
+  test is made atomically with the blocking of the thread, therefore a
+  call to @c wakeup_word() for this thread cannot be lost.
+
+  The thread may return for other reasons (a timeout, or a @c wakeup()),
+  so the caller must check @c *word again.
+
+  @param word the word to test
+  @param val the value of @c *word for which the thread blocks
+  @param mx the mutex to unlock, or NULL
+  @param cause the cause of the sleep
+  @param timeout a timeout for the sleep, or @c NO_TIMEOUT
+ */
+void sleep_on_word(volatile int* word, int val, Mutex* mx,
+	enum SCHED_CAUSE cause, TimerDuration timeout);
+
+/**
+  @brief Change a word and wakeup the thread that sleeps on it.
+
+  The word is changed from @c old to @c new by compare-and-swap,
+  atomically with respect to @c sleep_on_word() by @c tcb. If the change
+  is made and @c tcb is blocked, it is made @c READY, and it is queued
+  on the current core (if its affinity allows), where the caller has
+  just produced what it waits for.
+
+  The word is not accessed after it is changed, so it may be released
+  by @c tcb as soon as it sees the new value.
+
+  @param tcb the thread to wake up
+  @param word the word to change
+  @param old the expected value of @c *word
+  @param new the new value of @c *word
+  @returns 1 if the word was changed, 0 otherwise
+ */
+int wakeup_word(TCB* tcb, volatile int* word, int old, int new);
+
+/** @brief The affinity of a thread that may run on any core. */
+#define AFFINITY_ALL (~0u)
+
+/**
+  @brief Set the cores a thread may run on.
+
+  Bit @c c of @c mask allows the thread to run on core @c c. The new
+  affinity applies the next time the thread is scheduled; a running 
+  thread that restricts itself should call @c yield() to move.
+  New threads inherit the affinity of the thread that creates them.
+
+  @param tcb the thread
+  @param mask the new affinity, which must allow at least one core
+ */
+void set_core_affinity(TCB* tcb, uint mask);
+
 /**
   @brief Give up the CPU.
 
@@ -290,10 +437,11 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param opts the boot options, used to tune the scheduler
  */
-void initialize_scheduler(void);
+void initialize_scheduler(const boot_options* opts);
 
-void boost_thread(void);
 
 /**
   @brief Quantum (in microseconds) 
@@ -1,32 +1,350 @@
 
 #include "tinyos.h"
+#include "kernel_socket.h"
+#include "kernel_sched.h"
 
 
+/* A slot of the port table */
+typedef struct port_slot {
+	Mutex lock;				/* Protects the slot and the backlog */
+	socket_cb* listener;	/* The listener on this port, or NULL */
+	rlnode backlog;			/* Connections waiting for Accept */
+	uint backlog_count;		/* The length of the backlog */
+	CondVar req_available;	/* Accept waits here for connections */
+	CondVar space_available;	/* Connect waits here for backlog space */
+} port_slot;
+
+static port_slot PORT_MAP[MAX_PORT+1];
+
+
+void initialize_sockets()
+{
+	for(int p=0; p<=MAX_PORT; p++) {
+		PORT_MAP[p].lock = MUTEX_INIT;
+		PORT_MAP[p].listener = NULL;
+		rlnode_init(&PORT_MAP[p].backlog, NULL);
+		PORT_MAP[p].backlog_count = 0;
+		PORT_MAP[p].req_available = COND_INIT;
+		PORT_MAP[p].space_available = COND_INIT;
+	}
+}
+
+
+static socket_cb* socket_create(port_t port, socket_type type)
+{
+	socket_cb* sock = xmalloc(sizeof(socket_cb));
+	sock->refcount = 1;
+	sock->type = type;
+	sock->port = port;
+	sock->read_pipe = NULL;
+	sock->write_pipe = NULL;
+	sock->read_shut = 0;
+	sock->write_shut = 0;
+	rlnode_init(&sock->backlog_node, sock);
+	return sock;
+}
+
+
+/* 
+	Shut down directions of a peer socket. The pipes are not released, 
+	since other threads may still be using them through this socket.
+ */
+static void socket_peer_shut(socket_cb* sock, shutdown_mode how)
+{
+	if(how != SHUTDOWN_WRITE && ! __atomic_exchange_n(&sock->read_shut, 1, __ATOMIC_ACQ_REL))
+		pipe_shut_reader(sock->read_pipe);
+	if(how != SHUTDOWN_READ && ! __atomic_exchange_n(&sock->write_shut, 1, __ATOMIC_ACQ_REL))
+		pipe_shut_writer(sock->write_pipe);
+}
+
+
+static void socket_incref(socket_cb* sock)
+{
+	__atomic_add_fetch(&sock->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* 
+	Drop a reference; the last one closes the pipe ends of a connection 
+	and frees the socket 
+ */
+static void socket_decref(socket_cb* sock)
+{
+	if(__atomic_sub_fetch(&sock->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+		if(sock->type == SOCKET_PEER) {
+			pipe_reader_close(sock->read_pipe);
+			pipe_writer_close(sock->write_pipe);
+		}
+		free(sock);
+	}
+}
+
+
+/*
+	Stream operations
+ */
+
+static int socket_read(void* sockcb, char* buf, unsigned int n)
+{
+	socket_cb* sock = sockcb;
+	if(sock->type != SOCKET_PEER || sock->read_shut)
+		return -1;
+	return pipe_read(sock->read_pipe, buf, n);
+}
+
+
+static int socket_write(void* sockcb, const char* buf, unsigned int n)
+{
+	socket_cb* sock = sockcb;
+	if(sock->type != SOCKET_PEER || sock->write_shut)
+		return -1;
+	return pipe_write(sock->write_pipe, buf, n);
+}
+
+
+static int socket_readv(void* sockcb, const iovec_t* iov, unsigned int iovcnt)
+{
+	socket_cb* sock = sockcb;
+	if(sock->type != SOCKET_PEER || sock->read_shut)
+		return -1;
+	return pipe_readv(sock->read_pipe, iov, iovcnt);
+}
+
+
+static int socket_writev(void* sockcb, const iovec_t* iov, unsigned int iovcnt)
+{
+	socket_cb* sock = sockcb;
+	if(sock->type != SOCKET_PEER || sock->write_shut)
+		return -1;
+	return pipe_writev(sock->write_pipe, iov, iovcnt);
+}
+
+
+static int socket_close(void* sockcb)
+{
+	socket_cb* sock = sockcb;
+
+	if(sock->type == SOCKET_LISTENER) {
+		port_slot* slot = &PORT_MAP[sock->port];
+
+		/* Remove the listener and drop the connections in its backlog */
+		Mutex_Lock(&slot->lock);
+		slot->listener = NULL;
+		while(! is_rlist_empty(&slot->backlog)) {
+			socket_decref(rlist_pop_front(&slot->backlog)->socket);
+		}
+		slot->backlog_count = 0;
+		kernel_broadcast(&slot->req_available);
+		kernel_broadcast(&slot->space_available);
+		Mutex_Unlock(&slot->lock);
+	}
+
+	socket_decref(sock);
+	return 0;
+}
+
+
+static file_ops socket_ops = {
+	.Open = NULL,
+	.Read = socket_read,
+	.Write = socket_write,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev,
+	.Close = socket_close
+};
+
+
+/* Return the socket of a file id, holding a reference to it, or NULL */
+static socket_cb* get_socket_ref(Fid_t fid)
+{
+	socket_cb* sock = NULL;
+	FCB* fcb = get_fcb_ref(fid);
+	if(fcb) {
+		if(fcb->streamfunc == &socket_ops) {
+			sock = fcb->streamobj;
+			socket_incref(sock);
+		}
+		FCB_decref(fcb);
+	}
+	return sock;
+}
+
+
+pipe_cb* socket_read_pipe(FCB* fcb)
+{
+	if(fcb->streamfunc != &socket_ops) return NULL;
+	socket_cb* sock = fcb->streamobj;
+	return (sock->type == SOCKET_PEER && !sock->read_shut) ? sock->read_pipe : NULL;
+}
+
+
+pipe_cb* socket_write_pipe(FCB* fcb)
+{
+	if(fcb->streamfunc != &socket_ops) return NULL;
+	socket_cb* sock = fcb->streamobj;
+	return (sock->type == SOCKET_PEER && !sock->write_shut) ? sock->write_pipe : NULL;
+}
+
+
+
+/*
+	System calls
+ */
+
 Fid_t sys_Socket(port_t port)
 {
-	return NOFILE;
+	if(port < NOPORT || port > MAX_PORT)
+		return NOFILE;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	fcb->streamobj = socket_create(port, SOCKET_UNBOUND);
+	fcb->streamfunc = &socket_ops;
+	return fid;
 }
 
+
 int sys_Listen(Fid_t sock)
 {
-	return -1;
+	socket_cb* lsock = get_socket_ref(sock);
+	if(lsock == NULL)
+		return -1;
+
+	int retcode = -1;
+	if(lsock->port == NOPORT) goto finish;
+
+	port_slot* slot = &PORT_MAP[lsock->port];
+	Mutex_Lock(&slot->lock);
+	socket_type expected = SOCKET_UNBOUND;
+	if(slot->listener == NULL &&
+		__atomic_compare_exchange_n(&lsock->type, &expected, SOCKET_LISTENER,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		slot->listener = lsock;
+		retcode = 0;
+	}
+	Mutex_Unlock(&slot->lock);
+
+finish:
+	socket_decref(lsock);
+	return retcode;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {
-	return NOFILE;
+	socket_cb* listener = get_socket_ref(lsock);
+	if(listener == NULL)
+		return NOFILE;
+
+	Fid_t fid = NOFILE;
+	FCB* fcb;
+	if(listener->type != SOCKET_LISTENER) goto finish;
+
+	/* Reserve the fid first, so that we fail without waiting */
+	if(! FCB_reserve(1, &fid, &fcb)) {
+		fid = NOFILE;
+		goto finish;
+	}
+
+	port_slot* slot = &PORT_MAP[listener->port];
+	Mutex_Lock(&slot->lock);
+	while(slot->listener == listener && is_rlist_empty(&slot->backlog))
+		kernel_wait(&slot->lock, &slot->req_available, SCHED_PIPE);
+
+	if(slot->listener != listener) {
+		/* The listener was closed while we waited */
+		Mutex_Unlock(&slot->lock);
+		FCB_unreserve(1, &fid, &fcb);
+		fid = NOFILE;
+		goto finish;
+	}
+
+	socket_cb* peer = rlist_pop_front(&slot->backlog)->socket;
+	if(slot->backlog_count-- == SOCKET_BACKLOG)
+		kernel_broadcast(&slot->space_available);
+	Mutex_Unlock(&slot->lock);
+
+	/* The backlog reference of the peer passes to the FCB */
+	fcb->streamobj = peer;
+	fcb->streamfunc = &socket_ops;
+
+finish:
+	socket_decref(listener);
+	return fid;
 }
 
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	return -1;
+	if(port <= NOPORT || port > MAX_PORT)
+		return -1;
+
+	socket_cb* cli = get_socket_ref(sock);
+	if(cli == NULL)
+		return -1;
+
+	/* Claim the socket, so that other calls leave it alone */
+	int retcode = -1;
+	socket_type expected = SOCKET_UNBOUND;
+	if(! __atomic_compare_exchange_n(&cli->type, &expected, SOCKET_CONNECTING,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		goto finish;
+
+	/* A negative timeout means no timeout */
+	TimerDuration deadline = ((long)timeout < 0) ? NO_TIMEOUT
+		: bios_clock() + timeout*1000ul;
+
+	port_slot* slot = &PORT_MAP[port];
+	Mutex_Lock(&slot->lock);
+	while(slot->listener && slot->backlog_count >= SOCKET_BACKLOG) {
+		TimerDuration now = bios_clock();
+		if(deadline != NO_TIMEOUT && now >= deadline) break;
+		kernel_timedwait(&slot->lock, &slot->space_available, SCHED_PIPE,
+			(deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now);
+	}
+
+	if(slot->listener == NULL || slot->backlog_count >= SOCKET_BACKLOG) {
+		Mutex_Unlock(&slot->lock);
+		__atomic_store_n(&cli->type, SOCKET_UNBOUND, __ATOMIC_RELEASE);
+		goto finish;
+	}
+
+	/* Establish the connection and put the server end in the backlog */
+	socket_cb* peer = socket_create(port, SOCKET_PEER);
+	cli->write_pipe = peer->read_pipe = pipe_create(PIPE_BUFFER_SIZE);
+	cli->read_pipe = peer->write_pipe = pipe_create(PIPE_BUFFER_SIZE);
+	__atomic_store_n(&cli->type, SOCKET_PEER, __ATOMIC_RELEASE);
+
+	rlist_push_back(&slot->backlog, &peer->backlog_node);
+	if(slot->backlog_count++ == 0)
+		kernel_broadcast(&slot->req_available);
+	Mutex_Unlock(&slot->lock);
+	retcode = 0;
+
+finish:
+	socket_decref(cli);
+	return retcode;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
-	return -1;
-}
+	if(how < SHUTDOWN_READ || how > SHUTDOWN_BOTH)
+		return -1;
+
+	socket_cb* peer = get_socket_ref(sock);
+	if(peer == NULL)
+		return -1;
+
+	int retcode = -1;
+	if(peer->type != SOCKET_PEER) goto finish;
 
+	socket_peer_shut(peer, how);
+	retcode = 0;
+
+finish:
+	socket_decref(peer);
+	return retcode;
+}
@@ -0,0 +1,88 @@
+#ifndef __KERNEL_SOCKET_H
+#define __KERNEL_SOCKET_H
+
+/**
+	@file kernel_socket.h
+	@brief Local sockets.
+
+	@defgroup sockets Sockets
+	@ingroup kernel
+	@brief Local sockets.
+
+	A socket is a stream object, which is either unbound, or listening
+	on a port, or one end of a connection.
+
+	Each port has a slot in the port table, which is indexed directly by
+	the port number. A port slot holds the listener of the port (if any),
+	and the accept backlog of the listener: a bounded queue of connections
+	that have been established by @c Connect, but not yet taken by
+	@c Accept. Each port slot is protected by its own lock, therefore there
+	is no lock shared by connections on different ports.
+
+	A connection is made of two pipe control blocks, one for each direction.
+	Both peer sockets of the connection are created by @c Connect, so that
+	the client does not have to wait for @c Accept, unless the backlog of
+	the listener is full.
+
+	@{
+*/
+
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+#include "kernel_pipe.h"
+
+/** @brief The type of a socket. */
+typedef enum {
+	SOCKET_UNBOUND,		/**< @brief A new socket */
+	SOCKET_LISTENER,	/**< @brief A socket initialized by @c Listen */
+	SOCKET_CONNECTING,	/**< @brief An unbound socket inside @c Connect */
+	SOCKET_PEER			/**< @brief One end of a connection */
+} socket_type;
+
+
+/** @brief The socket control block. */
+typedef struct socket_control_block {
+	uint refcount;			/**< @brief References by the FCB and by blocked calls */
+	socket_type type;		/**< @brief The socket type, changed atomically */
+	port_t port;			/**< @brief The port given to @c Socket */
+
+	/* These are used by peer sockets */
+	pipe_cb* read_pipe;		/**< @brief The pipe read by this end */
+	pipe_cb* write_pipe;	/**< @brief The pipe written by this end */
+	int read_shut;			/**< @brief The read direction is shut down */
+	int write_shut;			/**< @brief The write direction is shut down */
+
+	rlnode backlog_node;	/**< @brief Node for the accept backlog */
+} socket_cb;
+
+
+/**
+	@brief Initialize the port table.
+
+	This function is called at kernel startup.
+*/
+void initialize_sockets();
+
+
+/**
+	@brief Return the pipe read by a socket stream, or NULL.
+
+	This returns NULL if the FCB is not a connected socket, or if its
+	read direction is shut down.
+	@see pipe_source
+*/
+pipe_cb* socket_read_pipe(FCB* fcb);
+
+/**
+	@brief Return the pipe written by a socket stream, or NULL.
+
+	This returns NULL if the FCB is not a connected socket, or if its
+	write direction is shut down.
+	@see pipe_sink
+*/
+pipe_cb* socket_write_pipe(FCB* fcb);
+
+/** @} */
+
+#endif
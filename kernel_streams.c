@@ -5,11 +5,13 @@
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_pipe.h"
 
 #define MAX_FILES MAX_PROC
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+Mutex FCB_freelist_lock = MUTEX_INIT;  /* Protects FCB_freelist */
 
 
 void initialize_files()
@@ -26,32 +28,36 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+
+  Mutex_Lock(&FCB_freelist_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
   }
-  else
-    return NULL;
+  Mutex_Unlock(&FCB_freelist_lock);
+
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(&FCB_freelist_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&FCB_freelist_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -67,6 +73,9 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     size_t f=0;
     uint i;
+    int ret = 0;
+
+    Mutex_Lock(&cur->fidt_lock);
 
     /* Find distinct fids */
     for(i=0; i<num; i++) {
@@ -75,7 +84,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +95,18 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
-    return 1;
+    ret = 1;
+
+finish:
+    Mutex_Unlock(&cur->fidt_lock);
+    return ret;
 }
 
 
@@ -101,11 +114,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->fidt_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->fidt_lock);
 }
 
 
@@ -128,6 +143,21 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb)
+    FCB_incref(fcb);
+  Mutex_Unlock(&cur->fidt_lock);
+
+  return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,16 +165,13 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream; the reference makes sure that the 
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -152,8 +179,6 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
 
 
   return retcode;
@@ -167,19 +192,15 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream; the reference makes sure that the 
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
@@ -193,16 +214,152 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/* 
+  The generic ReadV/WriteV, for streams without native support.
+
+  A vectored read must not block after it has read some data, so it
+  makes a single Read: small requests go through a kernel buffer and are
+  scattered, larger ones read into the first non-empty buffer only. 
+  A vectored write writes each buffer in turn, until a write is short.
+ */
+#define IOV_BOUNCE_SIZE 512
+
+static int generic_readv(FCB* fcb, const iovec_t* iov, unsigned int iovcnt)
+{
+  int (*devread)(void*,char*,uint) = fcb->streamfunc->Read;
+  if(devread == NULL) return -1;
+
+  unsigned int total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) total += iov[i].len;
+
+  if(total <= IOV_BOUNCE_SIZE) {
+    char buf[IOV_BOUNCE_SIZE];
+    int count = devread(fcb->streamobj, buf, total);
+    for(unsigned int i=0, pos=0; count>0 && pos<count; i++) {
+      unsigned int len = iov[i].len;
+      if(len > count-pos) len = count-pos;
+      memcpy(iov[i].base, buf+pos, len);
+      pos += len;
+    }
+    return count;
+  }
+
+  unsigned int i = 0;
+  while(iov[i].len == 0) i++;
+  return devread(fcb->streamobj, iov[i].base, iov[i].len);
+}
+
+static int generic_writev(FCB* fcb, const iovec_t* iov, unsigned int iovcnt)
+{
+  int (*devwrite)(void*,const char*,uint) = fcb->streamfunc->Write;
+  if(devwrite == NULL) return -1;
+
+  int total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = devwrite(fcb->streamobj, iov[i].base, iov[i].len);
+    if(rc < 0) return (total > 0) ? total : -1;
+    total += rc;
+    if(rc < iov[i].len) break;
+  }
+  return total;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOVEC) return -1;
+
+  int retcode = -1;
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    if(fcb->streamfunc->ReadV)
+      retcode = fcb->streamfunc->ReadV(fcb->streamobj, iov, iovcnt);
+    else
+      retcode = generic_readv(fcb, iov, iovcnt);
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOVEC) return -1;
+
+  int retcode = -1;
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    if(fcb->streamfunc->WriteV)
+      retcode = fcb->streamfunc->WriteV(fcb->streamobj, iov, iovcnt);
+    else
+      retcode = generic_writev(fcb, iov, iovcnt);
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+/* The size of the kernel buffer used by Splice on streams without pipes */
+#define SPLICE_BUFFER_SIZE 1024
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int size)
+{
+  int retcode = -1;
+
+  FCB* fin = get_fcb_ref(in);
+  FCB* fout = get_fcb_ref(out);
+  if(fin==NULL || fout==NULL) goto finish;
+
+  /* Nothing to move; do not wait for data */
+  if(size == 0) { retcode = 0; goto finish; }
+
+  pipe_cb* src = pipe_source(fin);
+  pipe_cb* dst = pipe_sink(fout);
+
+  if(src && dst && src != dst) {
+    /* Move the data directly between the pipe buffers */
+    retcode = pipe_splice(src, dst, size);
+  }
+  else if(fin->streamfunc->Read && fout->streamfunc->Write) {
+    /* Copy through a kernel buffer */
+    char buf[SPLICE_BUFFER_SIZE];
+    if(size > SPLICE_BUFFER_SIZE) size = SPLICE_BUFFER_SIZE;
+
+    int count = fin->streamfunc->Read(fin->streamobj, buf, size);
+    retcode = count;
+    for(int pos = 0; pos < count; ) {
+      int rc = fout->streamfunc->Write(fout->streamobj, buf+pos, count-pos);
+      if(rc < 1) { retcode = -1; break; }
+      pos += rc;
+    }
+  }
+
+finish:
+  if(fin) FCB_decref(fin);
+  if(fout) FCB_decref(fout);
+  return retcode;
+}
+
+
 int sys_Close(int fd)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  if(fd<0 || fd>=MAX_FILEID)
+    return -1;
 
+  int retcode = 0;  /* Closing a closed fd is legal! */
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
   FCB* fcb = get_fcb(fd);
+  cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->fidt_lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -221,19 +378,27 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
 
-  if(old==NULL) {
-    retcode = -1;
+  if(old==NULL || old==new) {
+    retcode = (old==NULL) ? -1 : 0;
+    new = NULL;
   }
-  else if(old!=new) {
-    if(new)
-      FCB_decref(new);
+  else {
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
 
+  Mutex_Unlock(&cur->fidt_lock);
+
+  /* Closing the replaced stream may block, do it without the lock */
+  if(new)
+    FCB_decref(new);
+
   return retcode;
 }
 
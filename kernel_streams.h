@@ -37,6 +37,9 @@
 	A file control block provides a uniform object to the
 	system calls, and contains pointers to device-specific
 	functions.
+
+	The reference count is updated atomically. The free list of
+	FCBs is protected by its own lock.
  */
 typedef struct file_control_block
 {
@@ -128,6 +131,19 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB and take a reference to it.
+
+	This is like @ref get_fcb, except that the reference count of the 
+	FCB is increased, atomically with respect to @c Close and @c Dup2
+	on the same fid by another thread. The caller must release the 
+	reference with @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
@@ -12,13 +12,12 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
-
-
-
-#define POST_CALL \
-kernel_unlock();\
+/*
+	There is no global kernel lock; each syscall takes the locks
+	of the kernel subsystems it uses.
+ */
+#define PRE_CALL
+#define POST_CALL
 
 
 /* with return */
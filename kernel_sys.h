@@ -15,14 +15,20 @@ SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetThreadAffinity, int, (Tid_t tid, unsigned int mask), (tid, mask))\
+SYSCALL(GetThreadCacheInfo, int, (thread_cache_info* info), (info))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(WriteV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(SizedPipe, int, (pipe_t* pipe, unsigned int size), (pipe, size))\
+SYSCALL(Splice, int, (Fid_t in, Fid_t out, unsigned int size), (in, out, size))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
@@ -33,7 +33,6 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
       TCB* new_tcb = spawn_thread(CURPROC, start_process_thread);  // Initialize and return a new TCB
       PCB* curproc = CURPROC;
-      curproc->thread_count ++;
 
 
       PTCB* ptcb = (PTCB* )xmalloc(sizeof(PTCB));   // Memory allocation for a PTCB block 
@@ -45,7 +44,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
       ptcb->exited = 0;
       ptcb->detached = 0;
       ptcb->exit_cv = COND_INIT;
-      ptcb->refcount = 1;
+      ptcb->refcount = 0;
       
       // Connections through PTCB, TCB
       ptcb->tcb = new_tcb; // PTCB with new_TCB
@@ -53,7 +52,10 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
     
       // Dealing with rlnode list
       rlnode_init(&(ptcb->ptcb_list_node), ptcb);                     //Initializing the rlnode in PTCB
+      Mutex_Lock(&proc_lock);
+      curproc->thread_count ++;
       rlist_push_back(&(curproc->ptcb_list), &(ptcb->ptcb_list_node));  //Pushing back on the list the current PTCB element 
+      Mutex_Unlock(&proc_lock);
     
       wakeup(new_tcb);
       return (Tid_t)ptcb;
@@ -69,62 +71,61 @@ Tid_t sys_ThreadSelf()
 	return (Tid_t) (cur_thread()->ptcb);   // easy
 }
 
+/**
+  @brief Release a PTCB that nobody can refer to any more.
+
+  Must be called with proc_lock held.
+  */
+static void release_PTCB(PTCB* ptcb)
+{
+  rlist_remove(&ptcb->ptcb_list_node);
+  free(ptcb);
+}
+
 /**
   @brief Join the given thread.
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
+  int ret = -1;
+  Mutex_Lock(&proc_lock);
+
   // Locate locally a ptcb
   PTCB* ptcb = (PTCB* ) tid;
-  if(!rlist_find(&(CURPROC->ptcb_list), ptcb, NULL)){
-    return -1;
+  if(rlist_find(&(CURPROC->ptcb_list), ptcb, NULL) == NULL){
+    goto finish;
   }
 
-  //if((Tid_t) cur_thread()->ptcb == 0){
-  //  return 0;
-  //}
-
-  // First, some checks to see if i can join
-  if((Tid_t) (cur_thread()->ptcb) == tid || (cur_thread()->ptcb->refcount) == 0){      // Cannot join self obviously...
-    return -1;
+  // Cannot join self, or a detached thread
+  if(ptcb == cur_thread()->ptcb || ptcb->detached){
+    goto finish;
   }
 
-  if (ptcb->detached == 1 && ptcb->exited == 1) {
-    return -1;
-  } 
-
-  // Check for test_detach_other
-  if(ptcb->detached == 1){
-    if(ptcb->exitval == 0) {
-      return -1;
-    }
+  // Sleep until the thread exits or gets detached
+  ptcb->refcount++;
+  while(ptcb->detached == 0 && ptcb->exited == 0){
+    kernel_wait(&proc_lock, &(ptcb->exit_cv), SCHED_USER);
   }
+  ptcb->refcount--;
 
-  // If you passed the checks, congratulations, now you have to wait and sleep, until the thread running finishes its work
-  // If there is a thread running right now, it has to put to sleep all other threads joining.
-  while(ptcb->detached == 0  && ptcb->exited == 0){
-    //if(ptcb->tcb->owner_pcb->parent->exitval == 1)
-    // return 0;
-    ptcb->refcount = ptcb->refcount + 1; // there is a new ptcb in town 
-    kernel_wait(&(ptcb->exit_cv), SCHED_USER);      // kernel_wait puts to temporary sleep incoming threads, waiting for the condvar of current thread to become detached or exited
-    // Saving the exit value...
-    //exitval = &(ptcb->exitval);
-    ptcb->refcount = ptcb->refcount - 1; // ptcb has left the chat
-
+  if(ptcb->detached){
+    // Detached while we were waiting; the last one out cleans up
+    if(ptcb->exited && ptcb->refcount == 0)
+      release_PTCB(ptcb);
+    goto finish;
   }
 
-  if(exitval!=NULL){
-    exitval = &(ptcb->exitval);
-    return 0;
-  } else {exitval = NULL;}
+  if(exitval != NULL)
+    *exitval = ptcb->exitval;
 
-  // You are alone... Bye...
-  if(ptcb->refcount <= 0){
-    if(ptcb->exited == 1){
-      rlist_remove(&(ptcb->ptcb_list_node));
-    }
-  }
-  return 0;
+  // The last joiner releases the exited thread
+  if(ptcb->refcount == 0)
+    release_PTCB(ptcb);
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&proc_lock);
+  return ret;
 }
 
 /**
@@ -132,32 +133,62 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  if(cur_thread() == NULL){
-    return -1;
+  int ret = -1;
+  Mutex_Lock(&proc_lock);
+
+  // Finding the thread to detach, connecting it with ptcb
+  PTCB* ptcb = (PTCB* ) tid;
+  if(rlist_find(&CURPROC->ptcb_list, ptcb, NULL) != NULL && !ptcb->exited){
+    // Nobody will join this thread; wake up anyone who is trying to
+    ptcb->detached = 1;
+    kernel_broadcast(&(ptcb->exit_cv));
+    ret = 0;
   }
 
+  Mutex_Unlock(&proc_lock);
+  return ret;
+}
 
-  // Finding the thread to join, connecting it with ptcb
-  PTCB* ptcb = (PTCB* ) tid;
-  if(!rlist_find(&CURPROC->ptcb_list, ptcb, NULL)){
+/**
+  @brief Set the cores on which a thread may run.
+  */
+int sys_SetThreadAffinity(Tid_t tid, unsigned int mask)
+{
+  // Only the cores that exist count
+  if(cpu_cores() < 32)
+    mask &= (1u << cpu_cores()) - 1;
+  if(mask == 0)
     return -1;
+
+  int ret = -1;
+  int self = 0;
+  Mutex_Lock(&proc_lock);
+
+  // The tcb of an exited thread is gone
+  PTCB* ptcb = (PTCB* ) tid;
+  if(rlist_find(&CURPROC->ptcb_list, ptcb, NULL) != NULL && ptcb->tcb != NULL){
+    set_core_affinity(ptcb->tcb, mask);
+    self = (ptcb->tcb == cur_thread());
+    ret = 0;
   }
 
-  if(ptcb->exited == 0){
-    if(ptcb->refcount>0){
-      // Detaching current and waking up next in line...
-      kernel_broadcast(&(ptcb->exit_cv)); // wakeup from your sleep, time to work 
-      ptcb->refcount = 0;  //nobody will join you 
-    }
-    ptcb->detached = 1;
+  Mutex_Unlock(&proc_lock);
 
-   //Current thread you are detached, free to go
-   // ptcb->detached == 1;
-   // free(ptcb);
-    return 0;
+  // Move away from the current core, if it is not allowed any more,
+  // keeping the priority level of the thread
+  if(self && !(mask & (1u << cpu_core_id)))
+    yield(SCHED_PREEMPT);
+
+  return ret;
 }
-return -1;
 
+
+int sys_GetThreadCacheInfo(thread_cache_info* info)
+{
+  if(info == NULL)
+    return -1;
+  thread_cache_stats(info);
+  return 0;
 }
 
 /**
@@ -165,85 +196,92 @@ return -1;
   */
 void sys_ThreadExit(int exitval)
 {
+  PCB* curproc = CURPROC;
+  PTCB* ptcb = cur_thread()->ptcb;
 
-PTCB* ptcb = (cur_thread()->ptcb);
+  Mutex_Lock(&proc_lock);
 
-// Brute exit now if someone remains...
-if(ptcb!=NULL){
   ptcb->exited = 1;
   ptcb->exitval = exitval;
-
-  PCB* curproc = CURPROC;
-  
+  ptcb->tcb = NULL;
   kernel_broadcast(&ptcb->exit_cv);
-  CURPROC->thread_count--;
 
+  // A detached thread that nobody waits for is released now
+  if(ptcb->detached && ptcb->refcount == 0)
+    release_PTCB(ptcb);
 
-  // See you soon...
-  if(cur_thread()->ptcb->refcount <= 0){
-    free(cur_thread()->ptcb);
-    curproc->thread_count = curproc->thread_count -1;
-  }
+  curproc->thread_count--;
+
+  // Only the last thread cleans up the process
+  if(curproc->thread_count > 0)
+    kernel_sleep(&proc_lock, EXITED, SCHED_USER);
+
+  Mutex_Unlock(&proc_lock);
 
-  if(get_pid(CURPROC) == 1){
+  if(get_pid(curproc) == 1){
+    /* The init process waits for all processes to exit */
     while(sys_WaitChild(NOPROC, NULL) != NOPROC);
-  } else {
-      // If you are the final thread
-      if(curproc->thread_count==0){
-        /* Reparent any children of the exiting process to the 
-        initial task */
-        PCB* initpcb = get_pcb(1);
-        while(!is_rlist_empty(& curproc->children_list)) {
-          rlnode* child = rlist_pop_front(& curproc->children_list);
-          child->pcb->parent = initpcb;
-          rlist_push_front(& initpcb->children_list, child);
-        }
-
-        /* Add exited children to the initial task's exited list 
-         and signal the initial task */
-        if(!is_rlist_empty(& curproc->exited_list)) {
-          rlist_append(& initpcb->exited_list, &curproc->exited_list);
-          kernel_broadcast(& initpcb->child_exit);
-        }
-
-        /* Put me into my parent's exited list */
-        rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-        kernel_broadcast(& curproc->parent->child_exit);   
-      }
-    }
-  assert(is_rlist_empty(& curproc->children_list));
-  assert(is_rlist_empty(& curproc->exited_list));
+  }
 
+  /* 
+    Do all the other cleanup we want here, close files etc. 
+   */
 
-    /* 
-      Do all the other cleanup we want here, close files etc. 
-     */
+  /* Release the args data */
+  if(curproc->args) {
+    free(curproc->args);
+    curproc->args = NULL;
+  }
 
-    /* Release the args data */
-    if(curproc->args) {
-      free(curproc->args);
-      curproc->args = NULL;
+  /* Clean up FIDT */
+  FCB* fidt[MAX_FILEID];
+  Mutex_Lock(&curproc->fidt_lock);
+  for(int i=0;i<MAX_FILEID;i++) {
+    fidt[i] = curproc->FIDT[i];
+    curproc->FIDT[i] = NULL;
+  }
+  Mutex_Unlock(&curproc->fidt_lock);
+  for(int i=0;i<MAX_FILEID;i++)
+    if(fidt[i] != NULL)
+      FCB_decref(fidt[i]);
+
+  Mutex_Lock(&proc_lock);
+
+  if(get_pid(curproc) != 1){
+    /* Reparent any children of the exiting process to the 
+       initial task */
+    PCB* initpcb = get_pcb(1);
+    while(!is_rlist_empty(& curproc->children_list)) {
+      rlnode* child = rlist_pop_front(& curproc->children_list);
+      child->pcb->parent = initpcb;
+      rlist_push_front(& initpcb->children_list, child);
     }
 
-    /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
+    /* Add exited children to the initial task's exited list 
+       and signal the initial task */
+    if(!is_rlist_empty(& curproc->exited_list)) {
+      rlist_append(& initpcb->exited_list, &curproc->exited_list);
+      kernel_broadcast(& initpcb->child_exit);
     }
 
+    /* Put me into my parent's exited list */
+    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
+    kernel_broadcast(& curproc->parent->child_exit);
+  }
+
+  assert(is_rlist_empty(& curproc->children_list));
+  assert(is_rlist_empty(& curproc->exited_list));
+
+  /* Release the PTCBs of threads that were never joined */
+  while(!is_rlist_empty(& curproc->ptcb_list))
+    free(rlist_pop_front(& curproc->ptcb_list)->ptcb);
+
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
 
   /* Now, mark the process as exited. */
   curproc->pstate = ZOMBIE;
-  curproc->exitval = exitval;
-}
 
-  
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
-
+  kernel_sleep(&proc_lock, EXITED, SCHED_USER);
 }
-
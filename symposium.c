@@ -9,7 +9,7 @@
 #include "tinyos.h"
 #include "symposium.h"
 
-#define QUIET 0  /* Use 1 for supperssing printing (for timing tests), 0 for normal printing */
+int symposium_quiet = 0;  /* Use 1 for supperssing printing (for timing tests), 0 for normal printing */
 
 /*
   This file contains a number of example programs for tinyos.
@@ -55,7 +55,7 @@ int RIGHT(int i, int N) { return (i+N-1) % N; }
  philosopher ph */
 void print_state(int N, PHIL* state, const char* fmt, int ph)
 {
-#if QUIET==0
+  if(symposium_quiet) return;
   int i;
   if(N<100) {
     for(i=0;i<N;i++) {
@@ -65,7 +65,6 @@ void print_state(int N, PHIL* state, const char* fmt, int ph)
     }
   }
   printf(fmt, ph);
-#endif
 }
 
 /* Functions think and eat (just burn CPU cycles). */
@@ -71,6 +71,9 @@
 */
 extern unsigned int fibo(unsigned int n);
 
+/** @brief Set to 1 to suppress the printing of philosopher states (e.g., in tests). */
+extern int symposium_quiet;
+
 /** @brief A philosopher's state. */
 typedef enum { NOTHERE=0, THINKING, HUNGRY, EATING } PHIL;
 
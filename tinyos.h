@@ -70,13 +70,13 @@ typedef uintptr_t Tid_t;
   
     Mutexes are used extensively to surround critical sections. The TinyOS
     mutexes are suitable for use in user-space, as well as in the implementation 
-    of the kernel.
+    of the kernel. A mutex is a single word, which records the thread that owns it.
 
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,8 +92,10 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
-  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
+  in kernel-space (preemptive domain), the locking spins only while the owner of
+  the mutex is running on another core, and then the thread blocks until the mutex
+  is unlocked. In scheduler space (non-preemptive domain), the mutex lock operation 
+  is pure spinlock.
 
   @see Mutex
   @see Mutex_Unlock
@@ -121,7 +123,8 @@ void Mutex_Unlock(Mutex*);
   @see COND_INIT
  */
 typedef struct {
-  void *waitset;        /**< The set of waiting threads */
+  void *waitset;        /**< The queue of waiting threads */
+  void *arrivals;       /**< Threads that started waiting, not yet in `waitset` */
   Mutex waitset_lock;   /**< A mutex to protect `waitset` */
 } CondVar;
 
@@ -133,7 +136,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, NULL, MUTEX_INIT })
 
 
 /** @brief Wait on a condition variable. 
@@ -202,6 +205,102 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief A reader-writer lock.
+
+  A reader-writer lock can be held by many readers at the same time, or 
+  by a single writer. It is used for data that is read often and changed
+  rarely. Writers are preferred: while a writer waits, new readers wait
+  behind it. The lock is not recursive; a reader that locks again while a
+  writer waits will deadlock.
+
+  Like a mutex, the lock is a single word. Threads that cannot take it
+  block directly in the scheduler.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+*/
+typedef unsigned int RWLock;
+
+/**
+  @brief This macro is used to initialize reader-writer locks.
+
+  @code
+   RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT 0
+
+/** @brief Lock a reader-writer lock for reading.
+
+  Wait as long as a writer holds the lock, or waits for it.
+  @see RWLock_ReadUnlock
+*/
+void RWLock_ReadLock(RWLock*);
+
+/** @brief Release a reader-writer lock that you locked for reading. 
+  
+  This operation is non-blocking.
+*/
+void RWLock_ReadUnlock(RWLock*);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  Wait as long as another writer or any reader holds the lock.
+  @see RWLock_WriteUnlock
+*/
+void RWLock_WriteLock(RWLock*);
+
+/** @brief Release a reader-writer lock that you locked for writing. 
+  
+  This operation is non-blocking.
+*/
+void RWLock_WriteUnlock(RWLock*);
+
+
+/** @brief A counting semaphore.
+
+  A semaphore holds a count. @c Sem_Wait waits until the count is positive 
+  and decrements it, and @c Sem_Post increments it. The semaphore is a 
+  single word; threads that wait block directly in the scheduler.
+
+  @see Sem_Wait
+  @see Sem_Post
+  @see SEM_INIT
+*/
+typedef unsigned int Semaphore;
+
+/**
+  @brief This macro is used to initialize semaphores.
+
+  The initial count is @c n, which must be less than 2^31.
+  @code
+   Semaphore my_sem = SEM_INIT(5);
+  @endcode
+ */
+#define SEM_INIT(n) (((Semaphore)(n)) << 1)
+
+/** @brief Wait until the count of a semaphore is positive, and decrement it. 
+  @see Sem_Post
+*/
+void Sem_Wait(Semaphore*);
+
+/** @brief Wait on a semaphore, with a timeout.
+
+  This is like @c Sem_Wait, but it waits for at most @c timeout milliseconds.
+  @returns 1 if the count was decremented, 0 if the timeout expired.
+*/
+int Sem_TimedWait(Semaphore*, timeout_t timeout);
+
+/** @brief Increment the count of a semaphore. 
+
+  If threads wait on the semaphore, one of them is woken up. 
+  This operation is non-blocking.
+  @see Sem_Wait
+*/
+void Sem_Post(Semaphore*);
+
+
 /*******************************************
  *
  * Process creation
@@ -374,6 +473,45 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Set the cores on which a thread may run.
+
+  Bit @c c of @c mask allows the thread to run on core @c c; bits
+  of cores that do not exist are ignored. The scheduler keeps the thread
+  on the allowed cores, preferring the core that last ran it. Threads 
+  (and processes) created later by the thread inherit its affinity.
+  If a thread changes its own affinity to exclude its current core, it 
+  moves to an allowed core before the call returns.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the bitmap of the allowed cores
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the mask does not allow any existing core.
+  */
+int SetThreadAffinity(Tid_t tid, unsigned int mask);
+
+/** @brief Statistics of the per-core caches of thread blocks.
+  @see GetThreadCacheInfo
+  */
+typedef struct thread_cache_info {
+  unsigned long hits;     /**< @brief Threads spawned with a recycled thread block */
+  unsigned long misses;   /**< @brief Threads spawned with fresh memory */
+  unsigned int cached;    /**< @brief Thread blocks now held by all caches */
+  unsigned int limit;     /**< @brief The most thread blocks each core may hold */
+} thread_cache_info;
+
+/**
+  @brief Get the statistics of the thread block caches.
+
+  The counters are summed over all cores.
+  @param info the statistics are stored here
+  @returns 0 on success, or -1 if @c info is NULL
+  @see boot_options
+  */
+int GetThreadCacheInfo(thread_cache_info* info);
+
 
 
 /*******************************************
@@ -458,6 +596,60 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief The maximum number of buffers passed to @c ReadV and @c WriteV. */
+#define MAX_IOVEC 64
+
+/** @brief A buffer for vectored I/O.
+
+	@see ReadV
+	@see WriteV
+ */
+typedef struct io_vector {
+	void* base;			/**< The start of the buffer */
+	unsigned int len;	/**< The size of the buffer */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into several buffers.
+
+   This call is like @c Read, except that the data is placed in the
+   @c iovcnt buffers of @c iov, filling each buffer before the next one.
+   The call blocks until some data is available, and then returns the 
+   total number of bytes read, which may be less than the total size of 
+   the buffers.
+
+  @param fd  the file ID of the stream to read from
+  @param iov an array of buffers
+  @param iovcnt the number of buffers in @c iov, at most @c MAX_IOVEC
+  @return the number of bytes read, 0 at end of data, or -1 on error. 
+   Possible errors are:
+   - The file id is invalid.
+   - @c iovcnt is larger than @c MAX_IOVEC.
+   - There was a I/O runtime problem.
+  @see Read
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from several buffers.
+
+   This call is like @c Write, except that the data is taken from the
+   @c iovcnt buffers of @c iov, in order. For example, a message header
+   and its payload can be written by a single call.
+
+  @param fd  the file ID of the stream to write to
+  @param iov an array of buffers
+  @param iovcnt the number of buffers in @c iov, at most @c MAX_IOVEC
+  @return the number of bytes written, or -1 on error. 
+   Possible errors are:
+   - The file id is invalid.
+   - @c iovcnt is larger than @c MAX_IOVEC.
+   - There was a I/O runtime problem.
+  @see Write
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
 /** @brief Close a file id.
    
 
@@ -531,6 +723,47 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+/**
+	@brief Construct and return a pipe with a given buffer size.
+
+	This is the same as @c Pipe(), except that the size of the pipe buffer
+	is given by the caller. The size is rounded up to a power of two, 
+	between 512 bytes and 1 Mbyte. A size of 0 selects the default size
+	used by @c Pipe().
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param size the requested buffer size, in bytes
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+	@see Pipe
+*/
+int SizedPipe(pipe_t* pipe, unsigned int size);
+
+/**
+	@brief Move data from one stream to another.
+
+	Read up to @c size bytes from stream @c in and write them to stream
+	@c out. The call blocks until some data is available at @c in, like
+	@c Read(), and then until all the data read has been written to 
+	@c out. 
+
+	When @c in and @c out are both backed by pipe buffers (e.g., pipe ends),
+	the data is moved directly between the buffers, without passing through
+	a user buffer. Otherwise, the data is copied through a kernel buffer.
+
+	If @c size is 0, the call returns 0 at once, without blocking.
+
+	@param in the file id to read from
+	@param out the file id to write to
+	@param size the maximum number of bytes to move
+	@returns the number of bytes moved, 0 if @c in is at end of data, or
+	   -1 on error. Possible reasons for error:
+		- @c in is not a valid file id, or it does not support @c Read
+		- @c out is not a valid file id, or it does not support @c Write
+		- the write to @c out failed
+*/
+int Splice(Fid_t in, Fid_t out, unsigned int size);
+
 /*******************************************
  *
  * Sockets (local)
@@ -554,6 +787,13 @@ typedef int16_t port_t;
 */
 #define NOPORT ((port_t)0)
 
+/**
+	@brief The maximum number of connections waiting for @c Accept on a port.
+
+	@see Connect
+*/
+#define SOCKET_BACKLOG 8
+
 
 /**
 	@brief Return a new socket bound on a port.
@@ -631,6 +871,12 @@ Fid_t Accept(Fid_t lsock);
 	The two connected sockets communicate by virtue of two pipes of opposite directions, 
 	but with one file descriptor servicing both pipes at each end.
 
+	The connection is established as soon as it is placed in the backlog
+	of the listener, where it waits for @c Accept. Data can be written to
+	@c sock before the connection is accepted. The backlog holds up to
+	@c SOCKET_BACKLOG connections; if it is full, the call blocks until
+	a connection is accepted, or the timeout expires.
+
 	The connect call will block for approximately the specified amount of time.
 	The resolution of this timeout is implementation specific, but should be
 	in the order of 100's of msec. Therefore, a timeout of at least 500 msec is
@@ -644,7 +890,7 @@ Fid_t Accept(Fid_t lsock);
 	   - the file id @c sock is not legal (i.e., an unconnected, non-listening socket)
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
-	   - the timeout has expired without a successful connection.
+	   - the timeout has expired with the backlog of the listener still full.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
 
@@ -768,6 +1014,49 @@ Fid_t OpenInfo();
  *
  *******************************************/
 
+/** @brief Default interval (in msec) between MLFQ priority boosts. */
+#define BOOT_BOOST_INTERVAL 500
+
+/** @brief Default number of thread blocks cached by each core. */
+#define BOOT_THREAD_CACHE_SIZE 16
+
+/** @brief Default thread stack size (in bytes). */
+#define BOOT_THREAD_STACK_SIZE (128 * 1024)
+
+/** @brief How thread stacks are allocated. */
+typedef enum {
+  STACK_MALLOC,   /**< @brief Stacks are allocated from the heap */
+  STACK_MMAP      /**< @brief Stacks are mapped without reserving swap, are 
+                       committed lazily, and have a guard page below them, so
+                       that a stack overflow causes a segmentation fault */
+} stack_mode;
+
+/** @brief Kernel tuning parameters, passed at boot.
+
+   Use @c BOOT_OPTIONS_DEFAULT to initialize an object of this type
+   and then adjust the fields of interest.
+
+   @see boot_with_options
+ */
+typedef struct boot_options {
+  timeout_t boost_interval; /**< @brief Time (in msec) between priority boosts of 
+                              each core's run queues, or 0 to disable boosting */
+  unsigned int thread_cache_size; /**< @brief Maximum number of recycled thread 
+                              blocks (TCB and stack) kept by each core. The caches
+                              are filled at boot. 0 disables the caches. */
+  stack_mode thread_stack_mode; /**< @brief How thread stacks are allocated */
+  unsigned int thread_stack_size; /**< @brief The stack size of each thread (in bytes), 
+                              rounded up to a multiple of the page size */
+} boot_options;
+
+/** @brief The default kernel tuning parameters. */
+#define BOOT_OPTIONS_DEFAULT ((boot_options){ \
+  .boost_interval = BOOT_BOOST_INTERVAL, \
+  .thread_cache_size = BOOT_THREAD_CACHE_SIZE, \
+  .thread_stack_mode = STACK_MALLOC, \
+  .thread_stack_size = BOOT_THREAD_STACK_SIZE \
+  })
+
 /** @brief Boot tinyos3. 
 
    The function must initialize the simulated computer with the given number of
@@ -780,6 +1069,15 @@ Fid_t OpenInfo();
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief Boot tinyos3 with the given tuning parameters.
+
+   This is the same as @c boot(), except that the kernel is tuned according
+   to @c opts. Calling @c boot() is equivalent to calling this function with
+   @c BOOT_OPTIONS_DEFAULT.
+   */
+void boot_with_options(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args,
+  const boot_options* opts);
+
 
 /** @} */
 
@@ -720,14 +720,20 @@ finish:
    the client program
 ************************/
 
-/* helper for RemoteClient */
-static void send_message(Fid_t sock, void* buf, size_t len)
+/* helper for RemoteClient: send the buffers of iov, in one call if possible */
+static void send_message(Fid_t sock, iovec_t* iov, unsigned int iovcnt)
 {
-	size_t count = 0;
+	size_t len = 0, count = 0;
+	for(unsigned int i=0; i<iovcnt; i++) len += iov[i].len;
+
 	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
+		int rc = WriteV(sock, iov, iovcnt);
 		if(rc<1) break;  /* Error or End of stream */
 		count += rc;
+
+		/* Skip what was written */
+		while(iovcnt>0 && rc >= iov->len) { rc -= iov->len; iov++; iovcnt--; }
+		if(iovcnt>0) { iov->base += rc; iov->len -= rc; }
 	}
 	if(count!=len) {
 		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
@@ -755,19 +761,15 @@ int RemoteClient(size_t argc, const char** argv)
 	argvpack(args, argc-1, argv+1);
 
 	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
-	send_message(sock, args, argl);
+	iovec_t msg[2] = {
+		{ .base = &argl, .len = sizeof(argl) },
+		{ .base = args, .len = argl }
+	};
+	send_message(sock, msg, 2);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
-	/* Read the server data and display */
-	char c;
-	FILE* fin = fidopen(sock, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(c, fout);
-	}
-	fclose(fin);
-	fclose(fout);
+	/* Forward the server data to the output */
+	while(Splice(sock, 1, 1024) > 0);
 	return 0;
 }
 
@@ -169,25 +169,108 @@ int Execute(Program prog, size_t argc, const char** argv)
 
 
 
-void BarrierSync(barrier* bar, unsigned int n)
+#define BARRIER_SLEEPER  ((uint64_t)1)
+#define BARRIER_ARRIVAL  ((uint64_t)1 << 16)
+#define BARRIER_EPOCH(s)  ((s) >> 32)
+#define BARRIER_ARRIVALS(s)  (((s) >> 16) & 0xffff)
+#define BARRIER_SLEEPERS(s)  ((s) & 0xffff)
+#define BARRIER_LEAF_COUNT(w)  ((w) & 0xffffffff)
+#define BARRIER_SPINS 1000
+
+static inline void barrier_relax()
 {
-	assert(n>0);
-	Mutex_Lock(& bar->mx);
+#if defined(__x86__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* The share of leaf i in n arrivals */
+static inline unsigned int barrier_leaf_size(unsigned int i, unsigned int n)
+{
+	return n / BARRIER_LEAVES + (i < n % BARRIER_LEAVES);
+}
 
-	int epoch = bar->epoch;
-	assert(bar->count < n);
+/*
+	Arrive at a leaf of the combining tree, in the given epoch. Return 1
+	if ours was the last arrival of the leaf. More than n arrivals in an 
+	epoch are an error, caught when no leaf has room.
+ */
+static int barrier_arrive_leaf(barrier* bar, unsigned int n, uint64_t epoch)
+{
+	uintptr_t h = ThreadSelf();
+	h ^= h >> 7;
+	h ^= h >> 13;
+
+	/* The shares add up to n, so some leaf has room for us */
+	for(unsigned int k = 0; k < BARRIER_LEAVES; k++) {
+		unsigned int i = (h + k) % BARRIER_LEAVES;
+		uint64_t* leaf = & bar->leaf[i].word;
+		unsigned int size = barrier_leaf_size(i, n);
+		uint64_t w = __atomic_load_n(leaf, __ATOMIC_RELAXED);
+
+		/* A complete leaf has moved on to the next epoch */
+		while(BARRIER_EPOCH(w) == epoch && BARRIER_LEAF_COUNT(w) < size) {
+			if(! __atomic_compare_exchange_n(leaf, &w, w+1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				continue;
+			if(BARRIER_LEAF_COUNT(w)+1 < size)
+				return 0;
+			__atomic_store_n(leaf, (epoch+1) << 32, __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+
+	assert(0); /* more than n threads arrived in this epoch */
+	return 0;
+}
+
+/* Wake up the children of sleeper j in the wakeup tree (the root is 0) */
+static void barrier_wake(barrier* bar, unsigned int parity, unsigned int j)
+{
+	unsigned int sleepers = bar->sleepers[parity];
+	for(unsigned int c = 2*j+1; c <= 2*j+2 && c <= sleepers; c++)
+		Sem_Post(& bar->gate[parity]);
+}
+
+void BarrierSync(barrier* bar, unsigned int n)
+{
+	assert(n>0 && n<=0xffff);
+
+	/* The epoch cannot end before we arrive */
+	uint64_t s = __atomic_load_n(& bar->state, __ATOMIC_ACQUIRE);
+	uint64_t epoch = BARRIER_EPOCH(s);
+	unsigned int parity = epoch & 1;
+
+	if(barrier_arrive_leaf(bar, n, epoch)) {
+		unsigned int leaves = (n < BARRIER_LEAVES) ? n : BARRIER_LEAVES;
+		s = __atomic_add_fetch(& bar->state, BARRIER_ARRIVAL, __ATOMIC_ACQ_REL);
+		assert(BARRIER_ARRIVALS(s) <= leaves);
+
+		if(BARRIER_ARRIVALS(s) == leaves) {
+			/* Open the next epoch, and count the threads that went to sleep */
+			s = __atomic_exchange_n(& bar->state, (epoch+1) << 32, __ATOMIC_ACQ_REL);
+			bar->sleepers[parity] = BARRIER_SLEEPERS(s);
+			bar->woken[parity] = 0;
+			barrier_wake(bar, parity, 0);
+			return;
+		}
+	}
 
-	bar->count ++;
-	if(bar->count == n) {
-		bar->epoch ++;
-		bar->count = 0;
-		Cond_Broadcast(&bar->cv);
+	for(int i=0; i<BARRIER_SPINS; i++) {
+		if(BARRIER_EPOCH(__atomic_load_n(& bar->state, __ATOMIC_ACQUIRE)) != epoch)
+			return;
+		barrier_relax();
 	}
 
-	while(epoch == bar->epoch)
-		Cond_Wait(&bar->mx, &bar->cv);
+	/* Register as a sleeper, unless the epoch is over */
+	s = __atomic_load_n(& bar->state, __ATOMIC_ACQUIRE);
+	do {
+		if(BARRIER_EPOCH(s) != epoch) return;
+	} while(! __atomic_compare_exchange_n(& bar->state, &s, s + BARRIER_SLEEPER, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-	Mutex_Unlock(& bar->mx);
+	Sem_Wait(& bar->gate[parity]);
+	barrier_wake(bar, parity, __atomic_add_fetch(& bar->woken[parity], 1, __ATOMIC_RELAXED));
 }
 
 
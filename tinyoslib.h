@@ -74,15 +74,44 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
 
+/** @brief The number of leaves in the combining tree of a barrier */
+#define BARRIER_LEAVES 8
+
+/**
+	@brief A reusable barrier.
+
+	Threads arrive along a combining tree of two levels. Each thread 
+	picks a leaf by its thread id, and each leaf takes a fixed share of 
+	the arrivals; a thread that finds its leaf full moves on to the next 
+	one. Only the last arrival of each leaf goes on to the root, so that 
+	the threads contend on a shared word in small groups.
+
+	The root is a single word, holding the current epoch and the numbers
+	of complete leaves and of threads that sleep in this epoch. Threads 
+	spin for a while on the word before they sleep. Sleepers of even and 
+	odd epochs sleep on different semaphores, and they are woken up along
+	a binary tree: the last arrival wakes up two sleepers, and each woken 
+	sleeper wakes up two more.
+  */
 typedef struct barrier {
-	Mutex mx;
-	CondVar cv;
-	unsigned int count, epoch;
+	uint64_t state;				/**< epoch (32 bits), complete leaves (16), sleepers (16) */
+	Semaphore gate[2];			/**< sleepers wait here, by epoch parity */
+	unsigned int sleepers[2];	/**< the sleepers of the last epoch of each parity */
+	unsigned int woken[2];		/**< the sleepers woken so far */
+	struct {
+		uint64_t word;			/**< epoch (32 bits), arrivals (32), in a cache line of its own */
+	} __attribute__((aligned(64))) leaf[BARRIER_LEAVES];
 } barrier;
 
-#define BARRIER_INIT  ((barrier){ MUTEX_INIT, COND_INIT, 0, 0})
+#define BARRIER_INIT  ((barrier){ .state = 0, .gate = { SEM_INIT(0), SEM_INIT(0) } })
 
 
+/**
+	@brief Wait until @c n threads have called @c BarrierSync on @c bar.
+
+	The barrier can be reused at once, by the same @c n threads. 
+	@c n must be less than 65536.
+  */
 void BarrierSync(barrier* bar, unsigned int n);
 
 
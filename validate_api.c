@@ -71,6 +71,76 @@ BARE_TEST(test_boot,
 }
 
 
+static int mmap_stack_thread(int argl, void* args) {
+	/* Touch most of a 64 kbyte stack */
+	volatile char buf[48*1024];
+	for(unsigned int i=0; i<sizeof(buf); i+=1024)
+		buf[i] = (char) argl;
+	return buf[argl % sizeof(buf) & ~1023u];
+}
+
+/* 
+	Check the layout of the stack of the current thread, in /proc/self/maps: 
+	the stack lies in a mapping of at least 'size' bytes, right above a 
+	non-accessible guard page.
+ */
+static int mmap_stack_layout(int size, void* args) {
+	char here;
+	uintptr_t addr = (uintptr_t) &here;
+	uintptr_t prev_end = 0, start, end;
+	char perms[5], prev_perms[5] = "";
+	int found = 0;
+
+	FILE* maps = fopen("/proc/self/maps", "r");
+	ASSERT(maps != NULL);
+	char line[512];
+	while(fgets(line, sizeof(line), maps)) {
+		ASSERT(sscanf(line, "%lx-%lx %4s", &start, &end, perms) == 3);
+		if(start <= addr && addr < end) { found = 1; break; }
+		prev_end = end;
+		strcpy(prev_perms, perms);
+	}
+	fclose(maps);
+
+	ASSERT(found);
+	ASSERT(perms[0]=='r' && perms[1]=='w');
+	/* The stack goes down to the start of the mapping, where the guard page is */
+	ASSERT(prev_end == start);
+	ASSERT(strncmp(prev_perms, "---", 3) == 0);
+	ASSERT(addr - start < (uintptr_t) size);
+	ASSERT(addr - start > (uintptr_t) size - 8*1024);
+	return 0;
+}
+
+static int mmap_stack_boot(int argl, void* args) {
+	int exitval = -1;
+	ASSERT(ThreadJoin(CreateThread(mmap_stack_layout, 64*1024, NULL), &exitval) == 0);
+	ASSERT(exitval == 0);
+
+	Tid_t tids[20];
+	for(int i=0; i<20; i++)
+		ASSERT((tids[i] = CreateThread(mmap_stack_thread, i, NULL)) != NOTHREAD);
+	for(int i=0; i<20; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval) == 0);
+		ASSERT(exitval == i);
+	}
+	return 0;
+}
+
+BARE_TEST(test_boot_with_mmap_stacks, 
+	"Test that the kernel runs threads on mmap-ed stacks of a\n"
+	"non-default size, selected by boot_with_options(...), and that\n"
+	"each stack lies right above a guard page.")
+{
+	boot_options opts = BOOT_OPTIONS_DEFAULT;
+	opts.thread_stack_mode = STACK_MMAP;
+	opts.thread_stack_size = 64*1024;
+	opts.thread_cache_size = 4;
+	boot_with_options(2, 0, mmap_stack_boot, 0, NULL, &opts);
+}
+
+
 
 
 /*********************************************
@@ -512,6 +582,56 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+/*
+	Test that signals are not lost, when they race with timeouts.
+ */
+
+struct token_args {
+	Mutex m;
+	CondVar cv;
+	int tokens;
+	int consumed;
+};
+
+static int token_consumer(int argl, void* args)
+{
+	struct token_args* A = args;
+	Mutex_Lock(&A->m);
+	for(int i=0; i<argl; i++) {
+		while(A->tokens == 0)
+			Cond_TimedWait(&A->m, &A->cv, 1);
+		A->tokens--;
+		A->consumed++;
+	}
+	Mutex_Unlock(&A->m);
+	return 0;
+}
+
+BOOT_TEST(test_cond_signal_races_timeout,
+	"Test that signals and broadcasts racing with short timed waits are not lost."
+	)
+{
+	struct token_args A = { .m = MUTEX_INIT, .cv = COND_INIT, .tokens = 0, .consumed = 0 };
+	const int N = 5, M = 200;
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(token_consumer, M, &A);
+
+	for(int i=0; i<N*M; i++) {
+		Mutex_Lock(&A.m);
+		A.tokens++;
+		if(i % 10) Cond_Signal(&A.cv); else Cond_Broadcast(&A.cv);
+		Mutex_Unlock(&A.m);
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(A.consumed == N*M && A.tokens == 0);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -906,6 +1026,7 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_boot_with_mmap_stacks,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
@@ -918,6 +1039,7 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_signal_races_timeout,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1156,6 +1278,36 @@ int join_many_threads_main(int argl, void* args) {
 }
 
 
+static int cache_thread(int argl, void* args) { return argl; }
+
+BOOT_TEST(test_thread_cache,
+	"Test that threads reuse the thread blocks of exited threads, and that the\n"
+	"caches of thread blocks do not grow beyond their limit."
+	)
+{
+	const unsigned int N = 200;
+	thread_cache_info before, after;
+	ASSERT(GetThreadCacheInfo(NULL) == -1);
+	ASSERT(GetThreadCacheInfo(&before) == 0);
+	ASSERT(before.limit == BOOT_THREAD_CACHE_SIZE);
+	ASSERT(before.cached <= before.limit * cpu_cores());
+
+	for(unsigned int i=0; i<N; i++) {
+		int exitval;
+		Tid_t t = CreateThread(cache_thread, i, NULL);
+		ASSERT(ThreadJoin(t, &exitval) == 0);
+		ASSERT(exitval == i);
+		ASSERT(GetThreadCacheInfo(&after) == 0);
+		ASSERT(after.cached <= after.limit * cpu_cores());
+	}
+
+	ASSERT(after.hits + after.misses >= before.hits + before.misses + N);
+	/* Each thread exits on some core, whose cache has a free slot or reuses a block */
+	ASSERT(after.hits >= before.hits + N/2);
+	return 0;
+}
+
+
 BOOT_TEST(test_join_many_threads,
 	"Test that many threads joining the same thread work ok")
 {
@@ -1395,6 +1547,404 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+struct affinity_pair
+{
+	pipe_t pipe;
+	unsigned int core[2];	/* the cores of the producer and the consumer */
+};
+
+static int affinity_pipe_thread(int argl, void* args)
+{
+	struct affinity_pair* P = args;
+	unsigned int core = P->core[argl];
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1u << core)==0);
+
+	char buf[64];	/* the pipe holds whole buffers */
+	for(int i=0; i<200; i++) {
+		ASSERT(cpu_core_id == core);
+		if(argl==0) {
+			memset(buf, i, sizeof(buf));
+			ASSERT(Write(P->pipe.write, buf, sizeof(buf))==sizeof(buf));
+		} else {
+			ASSERT(Read(P->pipe.read, buf, sizeof(buf))==sizeof(buf));
+			ASSERT(buf[0]==(char)i && buf[sizeof(buf)-1]==(char)i);
+		}
+	}
+	return 0;
+}
+
+struct affinity_symposium
+{
+	symposium_t symp;
+	SymposiumTable* S;
+	unsigned int core;
+};
+
+/* A philosopher that checks that it runs on the core of its creator */
+static int affinity_philosopher(int argl, void* args)
+{
+	struct affinity_symposium* A = args;
+	ASSERT(cpu_core_id == A->core);
+	SymposiumTable_philosopher(A->S, argl);
+	ASSERT(cpu_core_id == A->core);
+	return 0;
+}
+
+/* A process whose philosophers inherit its affinity */
+static int affinity_symposium_process(int argl, void* args)
+{
+	struct affinity_symposium A = *(struct affinity_symposium*) args;
+	ASSERT(cpu_core_id == A.core);
+
+	SymposiumTable S;
+	SymposiumTable_init(&S, &A.symp);
+	A.S = &S;
+
+	Tid_t tids[A.symp.N];
+	for(int i=0; i<A.symp.N; i++)
+		tids[i] = CreateThread(affinity_philosopher, i, &A);
+	for(int i=0; i<A.symp.N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	SymposiumTable_destroy(&S);
+	return 0;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that SetThreadAffinity keeps threads on their cores, using pipe producer/consumer\n"
+	"pairs pinned to the same and to different cores, and a symposium pinned to one core."
+	)
+{
+	unsigned int last = cpu_cores()-1;
+
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==-1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 0)==-1);
+
+	/* Move this thread to the last core */
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1u << last)==0);
+	ASSERT(cpu_core_id == last);
+
+	unsigned int placement[3][2] = { {0,0}, {0,last}, {last,0} };
+	for(int k=0; k<3; k++) {
+		struct affinity_pair P = { .core = { placement[k][0], placement[k][1] } };
+		ASSERT(SizedPipe(&P.pipe, 512)==0);
+
+		Tid_t t0 = CreateThread(affinity_pipe_thread, 0, &P);
+		Tid_t t1 = CreateThread(affinity_pipe_thread, 1, &P);
+		ASSERT(ThreadJoin(t0, NULL)==0);
+		ASSERT(ThreadJoin(t1, NULL)==0);
+		Close(P.pipe.read);
+		Close(P.pipe.write);
+	}
+
+	/* Threads and processes inherit the affinity of their creator */
+	symposium_quiet = 1;
+	struct affinity_symposium A = { .symp = { .N = 5, .bites = 5 }, .core = last };
+	adjust_symposium(&A.symp, -6, -6);
+	Pid_t pid = Exec(affinity_symposium_process, sizeof(A), &A);
+	ASSERT(pid != NOPROC);
+	int status;
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status == 0);
+
+	ASSERT(SetThreadAffinity(ThreadSelf(), ~0u)==0);
+	return 0;
+}
+
+
+struct mutex_counter
+{
+	Mutex mx;
+	unsigned long count;
+	int in_section;		/* threads inside the critical section */
+};
+
+static int mutex_counter_thread(int argl, void* args)
+{
+	struct mutex_counter* C = args;
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&C->mx);
+		ASSERT(C->in_section++ == 0);
+		C->count++;
+		/* Hold the lock for a while, sometimes long enough to be preempted */
+		for(volatile int j=0; j < ((i%50==0) ? 100000 : 100); j++);
+		ASSERT(--C->in_section == 0);
+		Mutex_Unlock(&C->mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a heavily contended Mutex provides mutual exclusion, and that\n"
+	"all threads waiting on it get the lock."
+	)
+{
+	const int N = 8, M = 500;
+	struct mutex_counter C = { .mx = MUTEX_INIT, .count = 0, .in_section = 0 };
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(mutex_counter_thread, M, &C);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(C.count == N*M);
+	ASSERT(C.mx == MUTEX_INIT);
+	return 0;
+}
+
+
+struct mutex_chain
+{
+	Mutex outer, first, second;
+	int in_first, in_second;
+	int rounds, count[4];
+};
+
+/*
+	Hold two contended mutexes, and keep working on the second after 
+	releasing the first, while the threads blocked on the second still
+	lend us their priority.
+ */
+static int mutex_chain_owner(int argl, void* args)
+{
+	struct mutex_chain* C = args;
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&C->first);
+		Mutex_Lock(&C->second);
+		ASSERT(C->in_first++ == 0 && C->in_second++ == 0);
+		for(volatile int j=0; j < ((i%5==0) ? 1000000 : 1000); j++);
+		ASSERT(--C->in_first == 0);
+		Mutex_Unlock(&C->first);
+
+		for(volatile int j=0; j < ((i%5==0) ? 1000000 : 1000); j++);
+		ASSERT(--C->in_second == 0);
+		C->rounds++;
+		Mutex_Unlock(&C->second);
+	}
+	return 0;
+}
+
+/*
+	Block on 'first' (argl==0) or on 'second' (argl==1). With argl==2, 
+	block on 'first' while holding 'outer', and with argl==3, block on
+	'outer', so that the priority of the latter is lent along the chain.
+ */
+static int mutex_chain_waiter(int argl, void* args)
+{
+	struct mutex_chain* C = args;
+	Mutex* mx = (argl == 1) ? &C->second : &C->first;
+	Semaphore never = SEM_INIT(0);
+	for(int i=0; i<100; i++) {
+		/* Sleep, to be scheduled above the busy owner */
+		Sem_TimedWait(&never, 1);
+
+		if(argl >= 2) Mutex_Lock(&C->outer);
+		if(argl <= 2) {
+			Mutex_Lock(mx);
+			int* in = (mx == &C->first) ? &C->in_first : &C->in_second;
+			ASSERT((*in)++ == 0);
+			ASSERT(--(*in) == 0);
+			Mutex_Unlock(mx);
+		}
+		C->count[argl]++;
+		if(argl >= 2) Mutex_Unlock(&C->outer);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_inheritance_chain,
+	"Test that a thread can hold two contended mutexes at once, with threads\n"
+	"blocked on each, and on a mutex held by a thread blocked on the first,\n"
+	"and that all of them get their locks."
+	)
+{
+	const int R = 200;
+	struct mutex_chain C = { .outer = MUTEX_INIT, .first = MUTEX_INIT, .second = MUTEX_INIT };
+
+	Tid_t owner = CreateThread(mutex_chain_owner, R, &C);
+	Tid_t tids[8];
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(mutex_chain_waiter, i%4, &C);
+
+	ASSERT(ThreadJoin(owner, NULL)==0);
+	for(int i=0; i<8; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(C.rounds == R);
+	for(int i=0; i<4; i++)
+		ASSERT(C.count[i] == 200);
+	ASSERT(C.outer == MUTEX_INIT && C.first == MUTEX_INIT && C.second == MUTEX_INIT);
+	return 0;
+}
+
+struct rwlock_table
+{
+	RWLock rw;
+	int value[16];		/* all equal, except inside a write section */
+	int readers;		/* readers inside a read section */
+	int writers;		/* writers inside a write section */
+	int max_readers;	/* the most readers seen together */
+};
+
+static int rwlock_thread(int argl, void* args)
+{
+	struct rwlock_table* T = args;
+	for(int i=0; i<200; i++) {
+		if(argl && i%10==0) {
+			RWLock_WriteLock(&T->rw);
+			ASSERT(T->writers++ == 0 && T->readers == 0);
+			for(int k=0; k<16; k++) T->value[k]++;
+			ASSERT(--T->writers == 0);
+			RWLock_WriteUnlock(&T->rw);
+		} else {
+			RWLock_ReadLock(&T->rw);
+			int r = __atomic_add_fetch(&T->readers, 1, __ATOMIC_RELAXED);
+			ASSERT(T->writers == 0);
+			if(r > T->max_readers) T->max_readers = r;
+			for(volatile int j=0; j < ((i%50==0) ? 100000 : 100); j++);
+			for(int k=1; k<16; k++) ASSERT(T->value[k] == T->value[0]);
+			__atomic_sub_fetch(&T->readers, 1, __ATOMIC_RELAXED);
+			RWLock_ReadUnlock(&T->rw);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock,
+	"Test that an RWLock excludes writers from everyone, that readers see\n"
+	"consistent data, and that the lock is free when all threads are done."
+	)
+{
+	const int N = 8;
+	struct rwlock_table T = { .rw = RWLOCK_INIT };
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(rwlock_thread, i%2, &T);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(T.value[0] == (N/2)*20);
+	ASSERT(T.max_readers >= 1);
+	ASSERT(T.rw == RWLOCK_INIT);
+	return 0;
+}
+
+
+struct sem_buffer
+{
+	Semaphore items, slots;
+	Mutex mx;
+	int buf[4];
+	unsigned int in, out;
+	long sum;
+};
+
+static int sem_producer(int argl, void* args)
+{
+	struct sem_buffer* B = args;
+	for(int i=1; i<=argl; i++) {
+		Sem_Wait(&B->slots);
+		Mutex_Lock(&B->mx);
+		B->buf[B->in++ % 4] = i;
+		Mutex_Unlock(&B->mx);
+		Sem_Post(&B->items);
+	}
+	return 0;
+}
+
+static int sem_consumer(int argl, void* args)
+{
+	struct sem_buffer* B = args;
+	for(int i=0; i<argl; i++) {
+		Sem_Wait(&B->items);
+		Mutex_Lock(&B->mx);
+		B->sum += B->buf[B->out++ % 4];
+		Mutex_Unlock(&B->mx);
+		Sem_Post(&B->slots);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_semaphore,
+	"Test a bounded buffer of producers and consumers synchronized by\n"
+	"semaphores, and the timeout of Sem_TimedWait."
+	)
+{
+	const int N = 4, M = 300;
+	struct sem_buffer B = { .items = SEM_INIT(0), .slots = SEM_INIT(4), .mx = MUTEX_INIT };
+
+	Tid_t tids[2*N];
+	for(int i=0; i<N; i++) {
+		tids[2*i] = CreateThread(sem_producer, M, &B);
+		tids[2*i+1] = CreateThread(sem_consumer, M, &B);
+	}
+	for(int i=0; i<2*N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(B.sum == N*(M*(M+1)/2));
+	ASSERT(B.items == SEM_INIT(0));
+	ASSERT(B.slots == SEM_INIT(4));
+
+	/* The count is taken without waiting, and then the wait times out */
+	Semaphore s = SEM_INIT(1);
+	ASSERT(Sem_TimedWait(&s, 100) == 1);
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_REALTIME, &t1);
+	ASSERT(Sem_TimedWait(&s, 100) == 0);
+	clock_gettime(CLOCK_REALTIME, &t2);
+	ASSERT(tspec2msec(t2)-tspec2msec(t1) >= 80);
+	ASSERT(s == SEM_INIT(0));
+	return 0;
+}
+
+
+struct barrier_phases
+{
+	barrier B;
+	unsigned int N;
+	unsigned int arrived[50];	/* arrivals at each phase */
+};
+
+static int barrier_phase_thread(int argl, void* args)
+{
+	struct barrier_phases* P = args;
+	for(int ph=0; ph<50; ph++) {
+		__atomic_add_fetch(&P->arrived[ph], 1, __ATOMIC_RELAXED);
+		/* Some threads arrive late, so that others go to sleep */
+		if(ph%10 == argl%10)
+			for(volatile int j=0; j<200000; j++);
+		BarrierSync(&P->B, P->N);
+		ASSERT(P->arrived[ph] == P->N);
+		if(ph+1 < 50) ASSERT(P->arrived[ph+1] < P->N);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_barrier_phases,
+	"Test that no thread leaves a phase of a reused barrier before all threads\n"
+	"have arrived, and that no thread completes the next phase early, with\n"
+	"fewer threads than the leaves of the barrier, and with more."
+	)
+{
+	const unsigned int sizes[] = { 3, 12, 21 };
+
+	for(int k=0; k<3; k++) {
+		struct barrier_phases P = { .B = BARRIER_INIT, .N = sizes[k] };
+
+		Tid_t tids[P.N];
+		for(unsigned int i=0; i<P.N; i++)
+			tids[i] = CreateThread(barrier_phase_thread, i, &P);
+		for(unsigned int i=0; i<P.N; i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+		ASSERT(P.B.gate[0] == SEM_INIT(0) && P.B.gate[1] == SEM_INIT(0));
+	}
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1408,11 +1958,18 @@ TEST_SUITE(thread_tests,
 	&test_detach_main_thread,
 	&test_detach_after_join,
 	&test_create_join_thread,
+	&test_thread_cache,
 	&test_join_many_threads,
 	&test_exit_many_threads,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_thread_affinity,
+	&test_mutex_contention,
+	&test_mutex_inheritance_chain,
+	&test_rwlock,
+	&test_semaphore,
+	&test_barrier_phases,
 	NULL
 };
 
@@ -1467,6 +2024,113 @@ BOOT_TEST(test_pipe_fails_on_exhausted_fid,
 }
 
 
+BOOT_TEST(test_sized_pipe,
+	"Test that SizedPipe rounds the buffer size up to a power of 2, and that\n"
+	"data wraps around the ring buffer correctly."
+	)
+{
+	pipe_t pipe;
+	char wbuf[2000], rbuf[2000];
+	for(uint i=0; i<sizeof(wbuf); i++) wbuf[i] = (char) i;
+
+	ASSERT(SizedPipe(&pipe, 600)==0);
+
+	/* A write fills the 1024 byte buffer, but does not block */
+	ASSERT(Write(pipe.write, wbuf, 2000)==1024);
+	ASSERT(Read(pipe.read, rbuf, 700)==700);
+	ASSERT(memcmp(rbuf, wbuf, 700)==0);
+
+	/* This write wraps around the end of the buffer */
+	ASSERT(Write(pipe.write, wbuf+1024, 976)==700);
+	ASSERT(Read(pipe.read, rbuf, 2000)==1024);
+	ASSERT(memcmp(rbuf, wbuf+700, 1024)==0);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_splice_pipes,
+	"Test that Splice moves data between two pipes, across the ends of\n"
+	"their ring buffers, and that it handles end of data and errors."
+	)
+{
+	pipe_t p1, p2;
+	char wbuf[1000], rbuf[1000];
+	for(uint i=0; i<sizeof(wbuf); i++) wbuf[i] = (char) (3*i);
+
+	ASSERT(SizedPipe(&p1, 512)==0);
+	ASSERT(SizedPipe(&p2, 1024)==0);
+
+	/* Move the read/write positions, so that copies wrap around */
+	ASSERT(Write(p1.write, wbuf, 300)==300);
+	ASSERT(Read(p1.read, rbuf, 300)==300);
+	ASSERT(Write(p2.write, wbuf, 900)==900);
+	ASSERT(Read(p2.read, rbuf, 900)==900);
+
+	ASSERT(Write(p1.write, wbuf, 500)==500);
+	ASSERT(Splice(p1.read, p2.write, 1000)==500);
+	ASSERT(Read(p2.read, rbuf, 1000)==500);
+	ASSERT(memcmp(rbuf, wbuf, 500)==0);
+
+	/* A zero size moves nothing, even when data and space are available */
+	ASSERT(Write(p1.write, wbuf, 5)==5);
+	ASSERT(Splice(p1.read, p2.write, 0)==0);
+	ASSERT(Read(p1.read, rbuf, 10)==5);
+
+	/* Bad file ids and wrong directions */
+	ASSERT(Splice(NOFILE, p2.write, 10)==-1);
+	ASSERT(Splice(p1.read, p2.read, 10)==-1);
+
+	/* End of data */
+	ASSERT(Close(p1.write)==0);
+	ASSERT(Splice(p1.read, p2.write, 10)==0);
+
+	/* Broken pipe */
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Write(p1.write, wbuf, 10)==10);
+	ASSERT(Close(p2.read)==0);
+	ASSERT(Splice(p1.read, p2.write, 10)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_vectored_io,
+	"Test ReadV and WriteV on pipes, and on a stream without native support."
+	)
+{
+	pipe_t pipe;
+	ASSERT(SizedPipe(&pipe, 512)==0);
+
+	int hdr = 7, hdr2 = 0;
+	char payload[600], payload2[600];
+	for(uint i=0; i<sizeof(payload); i++) payload[i] = (char) i;
+
+	/* A header and a payload, in one call; the write stops when the pipe is full */
+	iovec_t out[3] = {
+		{ .base = &hdr, .len = sizeof(hdr) },
+		{ .base = NULL, .len = 0 },
+		{ .base = payload, .len = sizeof(payload) }
+	};
+	ASSERT(WriteV(pipe.write, out, 3)==512);
+
+	iovec_t in[2] = {
+		{ .base = &hdr2, .len = sizeof(hdr2) },
+		{ .base = payload2, .len = sizeof(payload2) }
+	};
+	ASSERT(ReadV(pipe.read, in, 2)==512);
+	ASSERT(hdr2==7);
+	ASSERT(memcmp(payload, payload2, 512-sizeof(hdr))==0);
+
+	ASSERT(ReadV(pipe.read, in, MAX_IOVEC+1)==-1);
+	ASSERT(WriteV(NOFILE, out, 3)==-1);
+
+	/* The null device uses the generic implementation */
+	Fid_t fnull = OpenNull();
+	ASSERT(WriteV(fnull, out, 3)==sizeof(hdr)+sizeof(payload));
+	ASSERT(ReadV(fnull, in, 2)>0);
+	return 0;
+}
+
 
 BOOT_TEST(test_pipe_close_reader,
 	"Open a pipe and put just a little data in it"
@@ -1636,6 +2300,9 @@ TEST_SUITE(pipe_tests,
 {
 	&test_pipe_open,
 	&test_pipe_fails_on_exhausted_fid,
+	&test_sized_pipe,
+	&test_splice_pipes,
+	&test_pipe_vectored_io,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
@@ -1874,9 +2541,12 @@ BOOT_TEST(test_accept_fails_on_exhausted_fid,
 	/* Ok, we should be able to get another client */
 	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
 
-	/* Now, if we try a connection we should fail! */
+	/* Now, if we try to accept a connection we should fail! */
+	ASSERT(Accept(lsock)==NOFILE);
+
+	/* The connection is made, but it stays in the backlog */
+	ASSERT(Connect(cli, 100, 1000)==0);
 	ASSERT(Accept(lsock)==NOFILE);
-	ASSERT(Connect(cli, 100, 1000)==-1);
 
 	return 0;
 }
@@ -1965,7 +2635,7 @@ BOOT_TEST(test_connect_fails_on_non_listened_port,
 }
 
 BOOT_TEST(test_connect_fails_on_timeout,
-	"Test that connect fails on timeout.",
+	"Test that connect fails on timeout, when the backlog of the listener is full.",
 	.timeout = 2
 	)
 {
@@ -1973,6 +2643,10 @@ BOOT_TEST(test_connect_fails_on_timeout,
 	ASSERT(lsock!=NOFILE);
 	ASSERT(Listen(lsock)==0);
 
+	/* Fill the backlog */
+	for(int i=0; i<SOCKET_BACKLOG; i++)
+		ASSERT(Connect(Socket(NOPORT), 100, 100)==0);
+
 	Fid_t cli = Socket(10);
 	/* Give it a short timeout */
 	ASSERT(Connect(cli, 100, 100)==-1);
@@ -1981,6 +2655,43 @@ BOOT_TEST(test_connect_fails_on_timeout,
 }
 
 
+BOOT_TEST(test_connect_uses_backlog,
+	"Test that Connect does not wait for Accept, that data can be sent before\n"
+	"the connection is accepted, and that closing the listener drops the\n"
+	"connections in its backlog."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli1 = Socket(NOPORT), cli2 = Socket(NOPORT);
+	ASSERT(Connect(cli1, 100, 100)==0);
+	ASSERT(Connect(cli2, 100, 100)==0);
+	ASSERT(Write(cli1, "Hello world", 12)==12);
+
+	/* Connections are accepted in order */
+	char buffer[12];
+	Fid_t srv1 = Accept(lsock);
+	ASSERT(srv1!=NOFILE);
+	ASSERT(Read(srv1, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	check_transfer(srv1, cli1);
+
+	/* The second connection is dropped */
+	ASSERT(Close(lsock)==0);
+	ASSERT(Read(cli2, buffer, 12)==0);
+	ASSERT(Write(cli2, "Hello world", 12)==-1);
+
+	/* Splice works on sockets */
+	ASSERT(Write(cli1, "Hello world", 12)==12);
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(Splice(srv1, p.write, 100)==12);
+	ASSERT(Read(p.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	return 0;
+}
+
 
 BOOT_TEST(test_socket_small_transfer,
 	"Open a socket and put just a little data in it, in both directions, for many times."
@@ -2168,6 +2879,54 @@ BOOT_TEST(test_shudown_write,
 
 
 
+static int shutdown_race_reader(int argl, void* args)
+{
+	Fid_t sock = argl;
+	char buffer[12];
+	int rc;
+	while((rc = Read(sock, buffer, 12)) > 0);
+	return rc;
+}
+
+BOOT_TEST(test_shutdown_races_blocked_read,
+	"Test that ShutDown with SHUTDOWN_READ wakes up a Read blocked on the\n"
+	"socket, also when it races with the peer closing its end."
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	for(int i=0; i<200; i++) {
+		Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+		Fid_t srv;
+		connect_sockets(cli, lsock, &srv, 100);
+
+		Tid_t t = CreateThread(shutdown_race_reader, cli, NULL);
+		if(i == 0) {
+			/* Let the reader block first */
+			Mutex mx = MUTEX_INIT;
+			CondVar cv = COND_INIT;
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, 50);
+			Mutex_Unlock(&mx);
+		}
+		if(i % 2) 
+			ASSERT(Close(srv)==0);
+		ASSERT(ShutDown(cli, SHUTDOWN_READ)==0);
+
+		int rc;
+		ASSERT(ThreadJoin(t, &rc)==0);
+		ASSERT(rc == -1 || (rc == 0 && i%2));
+		ASSERT(Close(cli)==0);
+		if(i % 2 == 0) 
+			ASSERT(Close(srv)==0);
+	}
+
+	return 0;
+}
+
+
+
 
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
@@ -2196,6 +2955,7 @@ TEST_SUITE(socket_tests,
 	&test_connect_fails_on_illegal_port,
 	&test_connect_fails_on_non_listened_port,
 	&test_connect_fails_on_timeout,
+	&test_connect_uses_backlog,
 
 	&test_socket_small_transfer,
 	&test_socket_single_producer,
@@ -2203,6 +2963,7 @@ TEST_SUITE(socket_tests,
 
 	&test_shudown_read,
 	&test_shudown_write,
+	&test_shutdown_races_blocked_read,
 
 	NULL
 };